@@ -5,6 +5,11 @@
 #include <termios.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include <pjlib.h>
 #include <pjlib-util.h>
@@ -16,20 +21,125 @@
 #include <pjsua-lib/pjsua.h>
 
 #include <unistd.h>
+#include <string.h>
 
+#include "log.h"
 #include "config.h"
 
+// defaults for optional config.h settings
+#ifndef USE_ICE
+#define USE_ICE 0
+#endif
+#ifndef TURN_CONN_TYPE
+#define TURN_CONN_TYPE PJ_TURN_TP_UDP
+#endif
+#if defined(TURN_SERVER) && !USE_ICE
+// TURN relays are only used as ICE candidates
+#error "TURN_SERVER requires USE_ICE 1"
+#endif
+#ifndef USE_VAD
+#define USE_VAD 0
+#endif
+#ifndef VAD_THRESHOLD
+#define VAD_THRESHOLD -1
+#endif
+#ifndef USE_CN
+#define USE_CN USE_VAD
+#endif
+#ifndef LOG_BINARY_PATH
+#define LOG_BINARY_PATH NULL
+#endif
+#ifndef USE_TONES
+#ifdef AUDIO_SOCKET_PATH
+// there's no speaker to play them on
+#define USE_TONES 0
+#else
+#define USE_TONES 1
+#endif
+#endif
+#if USE_TONES && defined(AUDIO_SOCKET_PATH)
+#error "USE_TONES needs a sound device; it can't be used with AUDIO_SOCKET_PATH"
+#endif
+#ifndef DTMF_SIDETONE_MS
+#define DTMF_SIDETONE_MS 160
+#endif
+#ifndef BUSY_TONE_MS
+#define BUSY_TONE_MS 3000
+#endif
+#ifndef RACE_TRANSPORTS
+#define RACE_TRANSPORTS 0
+#endif
+#ifndef RACE_STAGGER_MS
+#define RACE_STAGGER_MS 250
+#endif
+#ifndef RACE_TIMEOUT_MS
+#define RACE_TIMEOUT_MS 32000
+#endif
+
+// binary log record types, see log_binary()
+#define LOG_REC_CALL_STATE 1
+
+#if RACE_TRANSPORTS
+// a way to reach the registrar, which can race against the others
+typedef struct {
+    char *name;
+    pjsip_transport_type_e type;
+    // appended to sip uris to force this transport
+    char *uri_param;
+    bool ipv6;
+} race_path_t;
+
+static const race_path_t race_paths[] = {
+    #if USE_TLS
+    { "tls4", PJSIP_TRANSPORT_TLS, "", false },
+    { "tls6", PJSIP_TRANSPORT_TLS6, "", true },
+    #else // not USE_TLS
+    { "udp4", PJSIP_TRANSPORT_UDP, ";transport=udp", false },
+    { "udp6", PJSIP_TRANSPORT_UDP6, ";transport=udp", true },
+    { "tcp4", PJSIP_TRANSPORT_TCP, ";transport=tcp", false },
+    { "tcp6", PJSIP_TRANSPORT_TCP6, ";transport=tcp", true },
+    #endif // USE_TLS
+};
+#define RACE_NPATHS (sizeof(race_paths)/sizeof(*race_paths))
+#endif // RACE_TRANSPORTS
+
+typedef enum {
+    // make or receive a real call
+    MODE_CALL,
+    // measure latency against an echo instance that we start ourselves
+    MODE_LATENCY,
+    // auto-answer on loopback and send all audio straight back
+    MODE_ECHO,
+} mode_e;
+
 typedef struct {
     char phone_number[128];
     pjsua_acc_id aid;
     pjsua_call_id cid;
     bool rx;
+    mode_e mode;
+    // the loopback port of the echo instance
+    unsigned short echo_port;
+    #if RACE_TRANSPORTS
+    // PJSUA_INVALID_ID for paths whose transport we couldn't create
+    pjsua_transport_id tids[RACE_NPATHS];
+    // the path that won the registration race
+    const race_path_t *path;
+    #endif
 } pjsip_globals_t;
 
 // embed our ring audio
 
 #include "wav.c"
 
+// embed the latency probe signal
+
+#include "mls.c"
+
+// embed dtmf, ringback and busy tones
+
+#include "tones.c"
+
 pj_status_t ring_cb(
     void *user_data,
     pj_uint32_t timestamp,
@@ -96,27 +206,782 @@ static void on_incoming_call(
     // respond that we are ringing, makes other side hear ringing too
     pj_status_t pret = pjsua_call_answer(call_id, 180, NULL, NULL);
     if(pret != PJ_SUCCESS){
-        fprintf(stderr, "failed to answer call\n");
+        log_printf("failed to answer call\n");
         exit(1);
     }
 
+    #ifndef AUDIO_SOCKET_PATH
     // actually play the ring audio
     int ret = ring();
     if(ret){
-        fprintf(stderr, "failed to play ring audio\n");
+        log_printf("failed to play ring audio\n");
         exit(1);
     }
+    #endif
 
     // auto-answer
     pret = pjsua_call_answer(call_id, 200, NULL, NULL);
     if(pret != PJ_SUCCESS){
-        fprintf(stderr, "failed to answer call\n");
+        log_printf("failed to answer call\n");
         exit(1);
     }
     in_call = true;
     rx_call_id = call_id;
 }
 
+// echo mode: no ringing, no waiting
+static void on_echo_incoming_call(
+    pjsua_acc_id acc_id, pjsua_call_id call_id, pjsip_rx_data *rdata
+){
+    pj_status_t pret = pjsua_call_answer(call_id, 200, NULL, NULL);
+    if(pret != PJ_SUCCESS){
+        log_printf("failed to answer call\n");
+        exit(1);
+    }
+    in_call = true;
+    rx_call_id = call_id;
+}
+
+
+/* Our own conference ports (the vad gate, the audio socket, the latency
+   probe) all start the same way: a struct beginning with a pjmedia_port, in
+   a pool of its own, with the bridge's audio format.  port_create() makes
+   one; fill in its callbacks, then hand it to port_add(). */
+static pjmedia_port *port_create(
+    const char *name, pj_uint32_t signature, size_t size, size_t extra,
+    pj_pool_t **pool_out
+){
+    pjsua_conf_port_info dev;
+    if(pjsua_conf_get_port_info(0, &dev) != PJ_SUCCESS) return NULL;
+    pj_pool_t *pool = pjsua_pool_create(name, 512 + size + extra, 512);
+    if(!pool) return NULL;
+    pjmedia_port *port = pj_pool_zalloc(pool, size);
+    pj_str_t pname = pj_str((char*)name);
+    pjmedia_port_info_init(
+        &port->info,
+        &pname,
+        signature,
+        dev.clock_rate,
+        1, // channel_count
+        16, // bits_per_sample
+        dev.samples_per_frame
+    );
+    *pool_out = pool;
+    return port;
+}
+
+static void port_release_pool(void *arg){
+    pj_pool_release((pj_pool_t*)arg);
+}
+
+/* Add a port, and the pool it lives in, to the bridge.  The bridge removes
+   ports asynchronously on its clock thread, and may call put_frame and
+   get_frame after pjsua_conf_remove_port() returns, so nothing can be freed
+   there.  Instead, the port gets a group lock whose destroy handlers run
+   port->on_destroy and then release the pool, once the bridge has dropped
+   its reference.  On failure, the port is destroyed and the pool released
+   before returning. */
+static int port_add(
+    pj_pool_t *pool, pjmedia_port *port, pjsua_conf_port_id *slot
+){
+    pj_status_t pret = pjmedia_port_init_grp_lock(port, pool, NULL);
+    if(pret == PJ_SUCCESS){
+        pret = pjmedia_port_add_destroy_handler(port, pool, &port_release_pool);
+    }
+    if(pret != PJ_SUCCESS){
+        // either way, this runs port->on_destroy but leaves the pool
+        pjmedia_port_destroy(port);
+        pj_pool_release(pool);
+        return 1;
+    }
+    pret = pjsua_conf_add_port(pool, port, slot);
+    if(pret != PJ_SUCCESS){
+        // releases the pool too, through port_release_pool
+        pjmedia_port_destroy(port);
+        return 1;
+    }
+    return 0;
+}
+
+// undo port_add(); the port and its pool go away when the bridge is done
+static void port_remove(pjmedia_port *port, pjsua_conf_port_id slot){
+    pjsua_conf_remove_port(slot);
+    pjmedia_port_destroy(port);
+}
+
+
+#if USE_VAD
+/* The vad gate sits between the microphone and the call in the conference
+   bridge.  Frames it judges to be silence are passed on as "no frame", which
+   the stream doesn't transmit.  Codec-level vad stays off, so the gate is
+   the only thing deciding what is silence: VAD_THRESHOLD means what it says,
+   and we count exactly how many frames were suppressed.  It adds one bridge
+   frame of latency to the transmit path. */
+typedef struct {
+    pjmedia_port base;
+    pjsua_conf_port_id slot;
+    pjmedia_silence_det *sd;
+    pj_int16_t *buf;
+    bool silent;
+    unsigned long frames;
+    unsigned long suppressed;
+} vad_gate_t;
+
+static vad_gate_t *vad_gate = NULL;
+// the last transmit stats of the call's stream, for the bytes-saved report
+static pjmedia_rtcp_stat vad_tx_stat;
+static bool vad_have_stat = false;
+
+static pj_status_t vad_put_frame(pjmedia_port *port, pjmedia_frame *frame){
+    vad_gate_t *g = (vad_gate_t*)port;
+    unsigned nsamples = PJMEDIA_PIA_SPF(&port->info);
+    if(frame->type != PJMEDIA_FRAME_TYPE_AUDIO || frame->size == 0){
+        // the mic gave us nothing, so there's nothing to suppress
+        g->silent = true;
+        return PJ_SUCCESS;
+    }
+    pj_memcpy(g->buf, frame->buf, nsamples * sizeof(pj_int16_t));
+    g->silent = pjmedia_silence_det_detect(g->sd, g->buf, nsamples, NULL);
+    g->frames++;
+    if(g->silent) g->suppressed++;
+    return PJ_SUCCESS;
+}
+
+static pj_status_t vad_get_frame(pjmedia_port *port, pjmedia_frame *frame){
+    vad_gate_t *g = (vad_gate_t*)port;
+    if(g->silent){
+        frame->type = PJMEDIA_FRAME_TYPE_NONE;
+        frame->size = 0;
+        return PJ_SUCCESS;
+    }
+    size_t size = PJMEDIA_PIA_AVG_FSZ(&port->info);
+    pj_memcpy(frame->buf, g->buf, size);
+    frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+    frame->size = size;
+    return PJ_SUCCESS;
+}
+
+// route the microphone (or whatever src is) through a new vad gate
+static int vad_start(pjsua_conf_port_id src, pjsua_conf_port_id call_slot){
+    pj_pool_t *pool;
+    vad_gate_t *g = (vad_gate_t*)port_create(
+        "vad", PJMEDIA_SIGNATURE('V', 'A', 'D', 'G'), sizeof(vad_gate_t), 0,
+        &pool
+    );
+    if(!g) return 1;
+    unsigned rate = PJMEDIA_PIA_SRATE(&g->base.info);
+    unsigned spf = PJMEDIA_PIA_SPF(&g->base.info);
+    g->silent = true;
+    g->buf = pj_pool_calloc(pool, spf, sizeof(pj_int16_t));
+    g->base.put_frame = &vad_put_frame;
+    g->base.get_frame = &vad_get_frame;
+
+    pj_status_t pret = pjmedia_silence_det_create(pool, rate, spf, &g->sd);
+    if(pret != PJ_SUCCESS){
+        pj_pool_release(pool);
+        return 1;
+    }
+    if(VAD_THRESHOLD < 0){
+        pjmedia_silence_det_set_adaptive(g->sd, -1, -1, -1);
+    }else{
+        pjmedia_silence_det_set_fixed(g->sd, VAD_THRESHOLD);
+    }
+
+    if(port_add(pool, &g->base, &g->slot) != 0) return 1;
+    pjsua_conf_connect(src, g->slot);
+    pjsua_conf_connect(g->slot, call_slot);
+    vad_gate = g;
+    return 0;
+}
+
+// remember the stream's transmit stats before pjsua throws them away
+static void vad_stream_destroyed(pjmedia_stream *strm, unsigned stream_idx){
+    if(stream_idx != 0) return;
+    if(pjmedia_stream_get_stat(strm, &vad_tx_stat) == PJ_SUCCESS){
+        vad_have_stat = true;
+    }
+}
+
+// report how much silence suppression saved, then tear down the vad gate
+static void vad_stop(pjsua_call_id cid){
+    if(!vad_gate) return;
+    if(!vad_have_stat){
+        // in case the stream is still around
+        pjsua_stream_stat ss;
+        if(pjsua_call_get_stream_stat(cid, 0, &ss) == PJ_SUCCESS){
+            vad_tx_stat = ss.rtcp;
+            vad_have_stat = true;
+        }
+    }
+    unsigned long frames = vad_gate->frames;
+    unsigned long suppressed = vad_gate->suppressed;
+    double pct = frames ? 100.0 * suppressed / frames : 0.0;
+    /* Bridge frames and codec packets are both 20 ms by default, so each
+       suppressed frame is one packet not sent: its payload plus the RTP, UDP
+       and IPv4 headers. */
+    double payload = 0;
+    if(vad_have_stat && vad_tx_stat.tx.pkt){
+        payload = (double)vad_tx_stat.tx.bytes / vad_tx_stat.tx.pkt;
+    }
+    unsigned long saved = (unsigned long)(suppressed * (payload + 12 + 8 + 20));
+    log_printf(
+        "vad: suppressed %lu of %lu frames (%.1f%%), saved ~%lu bytes\n",
+        suppressed, frames, pct, saved
+    );
+
+    port_remove(&vad_gate->base, vad_gate->slot);
+    vad_gate = NULL;
+    vad_have_stat = false;
+}
+#endif // USE_VAD
+
+
+#if USE_CN
+// does this media line list payload type 13 (comfort noise)?
+static bool sdp_has_cn(const pjmedia_sdp_media *m){
+    for(unsigned i = 0; i < m->desc.fmt_count; i++){
+        if(pj_strcmp2(&m->desc.fmt[i], "13") == 0) return true;
+    }
+    return false;
+}
+
+// advertise RFC 3389 comfort noise on audio, unless the offer left it out
+static void on_call_sdp_created(
+    pjsua_call_id cid,
+    pjmedia_sdp_session *sdp,
+    pj_pool_t *pool,
+    const pjmedia_sdp_session *rem_sdp
+){
+    (void)cid;
+    for(unsigned i = 0; i < sdp->media_count; i++){
+        pjmedia_sdp_media *m = sdp->media[i];
+        if(pj_strcmp2(&m->desc.media, "audio") != 0) continue;
+        if(m->desc.port == 0) continue;
+        if(sdp_has_cn(m)) continue;
+        if(m->desc.fmt_count >= PJMEDIA_MAX_SDP_FMT) continue;
+        // an answer may only include formats that were offered
+        if(rem_sdp){
+            if(i >= rem_sdp->media_count) continue;
+            if(!sdp_has_cn(rem_sdp->media[i])) continue;
+        }
+        pjmedia_sdp_rtpmap rtpmap;
+        pj_bzero(&rtpmap, sizeof(rtpmap));
+        rtpmap.pt = pj_str("13");
+        rtpmap.enc_name = pj_str("CN");
+        rtpmap.clock_rate = 8000;
+        pjmedia_sdp_attr *attr;
+        if(pjmedia_sdp_rtpmap_to_attr(pool, &rtpmap, &attr) != PJ_SUCCESS){
+            continue;
+        }
+        m->desc.fmt[m->desc.fmt_count++] = pj_str("13");
+        pjmedia_sdp_media_add_attr(m, attr);
+    }
+}
+#endif // USE_CN
+
+
+// turn codec-level vad off, and comfort noise generation on or off
+int set_codec_vad(void){
+    pjsua_codec_info codecs[64];
+    unsigned count = PJ_ARRAY_SIZE(codecs);
+    pj_status_t pret = pjsua_enum_codecs(codecs, &count);
+    if(pret != PJ_SUCCESS) return 1;
+    for(unsigned i = 0; i < count; i++){
+        pjmedia_codec_param param;
+        pret = pjsua_codec_get_param(&codecs[i].codec_id, &param);
+        if(pret != PJ_SUCCESS) continue;
+        // the vad gate decides what is silence, not the codec
+        param.setting.vad = 0;
+        param.setting.cng = USE_CN;
+        pret = pjsua_codec_set_param(&codecs[i].codec_id, &param);
+        if(pret != PJ_SUCCESS) return 1;
+    }
+    return 0;
+}
+
+
+#ifdef AUDIO_SOCKET_PATH
+/* Instead of a sound device, each call's audio can be bridged to a unix
+   socket, so another process can listen and talk.  We connect a
+   SOCK_SEQPACKET socket to AUDIO_SOCKET_PATH when the call's media starts.
+   The first packet we send is a text header like:
+
+       call=0 format=s16le rate=16000 channels=1 frame=640
+
+   After that, every packet in either direction is one frame of that many
+   bytes of audio, one per bridge tick.  Audio is sent from, and received
+   into, the bridge's own frame buffers, so nothing is copied on our side.
+
+   The conference bridge clock must never block, so neither direction
+   waits: a frame the other side isn't ready to receive is dropped, and a
+   tick with nothing to read is silence.  If the other side gets ahead of
+   the bridge clock (drift, or a burst) by more than PCM_SOCK_MAX_QUEUE
+   frames, we skip to its newest frame, so latency can't keep growing. */
+#define PCM_SOCK_MAX_QUEUE 3
+
+
+typedef struct {
+    pjmedia_port base;
+    pjsua_conf_port_id slot;
+    int fd;
+    bool closed;
+    // frames we dropped because the socket was full
+    unsigned long tx_dropped;
+    // ticks where the other side had no frame ready for us
+    unsigned long rx_missing;
+    // frames we skipped because the other side was too far ahead
+    unsigned long rx_skipped;
+} pcm_sock_t;
+
+static pcm_sock_t *pcm_sock = NULL;
+// big enough for a 20 ms frame at 192 kHz
+static char pcm_silence[8192];
+
+// audio from the call, out to the socket
+static pj_status_t pcm_sock_put_frame(pjmedia_port *port, pjmedia_frame *frame){
+    pcm_sock_t *ps = (pcm_sock_t*)port;
+    if(ps->closed) return PJ_SUCCESS;
+    size_t size = PJMEDIA_PIA_AVG_FSZ(&port->info);
+    // keep the stream continuous, even when the bridge has nothing for us
+    const void *buf = pcm_silence;
+    if(frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->size == size){
+        buf = frame->buf;
+    }
+    ssize_t zret = send(ps->fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(zret < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS){
+            ps->tx_dropped++;
+            return PJ_SUCCESS;
+        }
+        log_printf("audio socket send: %s\n", strerror(errno));
+        ps->closed = true;
+    }
+    return PJ_SUCCESS;
+}
+
+// audio from the socket, in to the call
+static pj_status_t pcm_sock_get_frame(pjmedia_port *port, pjmedia_frame *frame){
+    pcm_sock_t *ps = (pcm_sock_t*)port;
+    frame->type = PJMEDIA_FRAME_TYPE_NONE;
+    frame->size = 0;
+    if(ps->closed) return PJ_SUCCESS;
+    size_t size = PJMEDIA_PIA_AVG_FSZ(&port->info);
+    // on a seqpacket socket, this is every queued byte, not just one packet
+    int queued = 0;
+    if(ioctl(ps->fd, FIONREAD, &queued) == 0
+        && (size_t)queued > PCM_SOCK_MAX_QUEUE * size){
+        // discard all but the newest frame
+        while((size_t)queued > size){
+            ssize_t zret = recv(
+                ps->fd, frame->buf, size, MSG_DONTWAIT | MSG_TRUNC
+            );
+            if(zret <= 0) break;
+            queued -= (int)zret;
+            ps->rx_skipped++;
+        }
+    }
+    ssize_t zret = recv(ps->fd, frame->buf, size, MSG_DONTWAIT);
+    if(zret < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            ps->rx_missing++;
+            return PJ_SUCCESS;
+        }
+        log_printf("audio socket recv: %s\n", strerror(errno));
+        ps->closed = true;
+        return PJ_SUCCESS;
+    }
+    if(zret == 0){
+        log_printf("audio socket closed by peer\n");
+        ps->closed = true;
+        return PJ_SUCCESS;
+    }
+    // tolerate a short frame by padding it with silence
+    if((size_t)zret < size){
+        pj_bzero((char*)frame->buf + zret, size - (size_t)zret);
+    }
+    frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+    frame->size = size;
+    return PJ_SUCCESS;
+}
+
+static int pcm_sock_connect(void){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(AUDIO_SOCKET_PATH) >= sizeof(addr.sun_path)){
+        log_printf("AUDIO_SOCKET_PATH is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, AUDIO_SOCKET_PATH);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        log_printf("socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if(ret < 0){
+        log_printf("%s: %s\n", AUDIO_SOCKET_PATH, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// runs once the bridge is done with the port, so no send() can race it
+static pj_status_t pcm_sock_on_destroy(pjmedia_port *port){
+    close(((pcm_sock_t*)port)->fd);
+    return PJ_SUCCESS;
+}
+
+// bridge a call to a new connection on AUDIO_SOCKET_PATH
+static int pcm_sock_start(pjsua_call_id cid){
+    pjsua_conf_port_info dev;
+    pj_status_t pret = pjsua_conf_get_port_info(0, &dev);
+    if(pret != PJ_SUCCESS) return 1;
+    size_t frame_bytes = dev.samples_per_frame * sizeof(pj_int16_t);
+    if(frame_bytes > sizeof(pcm_silence)){
+        log_printf("bridge frames are too big for the audio socket\n");
+        return 1;
+    }
+
+    int fd = pcm_sock_connect();
+    if(fd < 0) return 1;
+
+    // tell the other side what to expect
+    char hdr[128];
+    int n = snprintf(hdr, sizeof(hdr),
+        "call=%d format=s16le rate=%u channels=1 frame=%zu\n",
+        cid, dev.clock_rate, frame_bytes
+    );
+    if(send(fd, hdr, (size_t)n, MSG_DONTWAIT | MSG_NOSIGNAL) != n){
+        log_printf("failed to send audio socket header\n");
+        close(fd);
+        return 1;
+    }
+
+    pj_pool_t *pool;
+    pcm_sock_t *ps = (pcm_sock_t*)port_create(
+        "pcmsock", PJMEDIA_SIGNATURE('P', 'C', 'M', 'S'), sizeof(pcm_sock_t), 0,
+        &pool
+    );
+    if(!ps){
+        close(fd);
+        return 1;
+    }
+    ps->fd = fd;
+    ps->base.put_frame = &pcm_sock_put_frame;
+    ps->base.get_frame = &pcm_sock_get_frame;
+    ps->base.on_destroy = &pcm_sock_on_destroy;
+
+    // on failure, this closes fd too
+    if(port_add(pool, &ps->base, &ps->slot) != 0) return 1;
+    pcm_sock = ps;
+    return 0;
+}
+
+static void pcm_sock_stop(void){
+    if(!pcm_sock) return;
+    log_printf(
+        "audio socket: dropped %lu outgoing frames, "
+        "%lu ticks without incoming audio, "
+        "skipped %lu incoming frames to catch up\n",
+        pcm_sock->tx_dropped, pcm_sock->rx_missing, pcm_sock->rx_skipped
+    );
+    port_remove(&pcm_sock->base, pcm_sock->slot);
+    pcm_sock = NULL;
+}
+#endif // AUDIO_SOCKET_PATH
+
+
+// like in_call, this is global so the pjsua callbacks can see it
+static mode_e mode = MODE_CALL;
+
+/* The latency probe is a conference port connected both ways to the call.
+   It plays a maximal-length sequence (from mls.c) LATENCY_BURSTS times, and
+   records everything it hears back.  The bridge stamps the frames it hands
+   to put_frame with its clock, but not the ones it asks get_frame to fill,
+   so playback counts its own get_frame calls instead.  Within a bridge tick,
+   every port is read before any is written, so the first put_frame after
+   playback starts belongs to the same tick as the latest get_frame; that
+   ties our playback count to the bridge clock.  From then on the recording
+   is indexed by the bridge timestamp, so the offset of each burst in it is
+   exactly the round trip delay in samples, even though the bridge starts
+   calling the two directions on different ticks. */
+#define LATENCY_SETTLE_SEC 1
+#define LATENCY_PERIOD_SEC 2
+#define LATENCY_BURSTS 3
+#define LATENCY_MAX_LAG_SEC 1
+
+typedef struct {
+    pjmedia_port base;
+    pjsua_conf_port_id slot;
+    unsigned rate;
+    size_t settle;
+    size_t period;
+    size_t len;
+    // samples played so far
+    size_t tx_pos;
+    // the bridge timestamp of playback sample 0, once we know it
+    bool anchored;
+    pj_uint64_t ts0;
+    pj_int16_t *rec;
+    volatile bool done;
+} probe_t;
+
+static probe_t *probe = NULL;
+
+static pj_int16_t mls_sample(size_t i){
+    return (pj_int16_t)(mls_data[2*i] | (mls_data[2*i + 1] << 8));
+}
+
+static pj_status_t probe_get_frame(pjmedia_port *port, pjmedia_frame *frame){
+    probe_t *p = (probe_t*)port;
+    unsigned spf = PJMEDIA_PIA_SPF(&port->info);
+    size_t pos = p->tx_pos;
+    pj_int16_t *out = frame->buf;
+    for(unsigned i = 0; i < spf; i++){
+        size_t n = pos + i;
+        out[i] = 0;
+        if(n < p->settle) continue;
+        size_t burst = (n - p->settle) / p->period;
+        size_t off = (n - p->settle) % p->period;
+        if(burst < LATENCY_BURSTS && off < mls_samples){
+            out[i] = mls_sample(off);
+        }
+    }
+    p->tx_pos += spf;
+    frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+    frame->size = spf * sizeof(pj_int16_t);
+    return PJ_SUCCESS;
+}
+
+static pj_status_t probe_put_frame(pjmedia_port *port, pjmedia_frame *frame){
+    probe_t *p = (probe_t*)port;
+    // anything heard before we played a thing can't be an echo of it
+    if(p->done || !p->tx_pos) return PJ_SUCCESS;
+    if(!p->anchored){
+        // this tick's get_frame played the samples just before tx_pos
+        unsigned spf = PJMEDIA_PIA_SPF(&port->info);
+        p->ts0 = frame->timestamp.u64 - (p->tx_pos - spf);
+        p->anchored = true;
+    }
+    if(frame->timestamp.u64 < p->ts0) return PJ_SUCCESS;
+    size_t pos = (size_t)(frame->timestamp.u64 - p->ts0);
+    if(pos >= p->len){
+        p->done = true;
+        return PJ_SUCCESS;
+    }
+    size_t n = PJMEDIA_PIA_SPF(&port->info);
+    if(pos + n > p->len) n = p->len - pos;
+    // rec starts zeroed, so missing frames are already silence
+    if(frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->size){
+        pj_memcpy(p->rec + pos, frame->buf, n * sizeof(pj_int16_t));
+    }
+    if(pos + n == p->len) p->done = true;
+    return PJ_SUCCESS;
+}
+
+static int probe_start(pjsua_conf_port_id call_slot){
+    pjsua_conf_port_info dev;
+    pj_status_t pret = pjsua_conf_get_port_info(0, &dev);
+    if(pret != PJ_SUCCESS) return 1;
+
+    size_t len = (LATENCY_SETTLE_SEC + LATENCY_PERIOD_SEC * LATENCY_BURSTS)
+                 * (size_t)dev.clock_rate;
+    pj_pool_t *pool;
+    probe_t *p = (probe_t*)port_create(
+        "probe", PJMEDIA_SIGNATURE('P', 'R', 'B', 'E'), sizeof(probe_t),
+        len * sizeof(pj_int16_t), &pool
+    );
+    if(!p) return 1;
+    p->rate = dev.clock_rate;
+    p->settle = LATENCY_SETTLE_SEC * (size_t)dev.clock_rate;
+    p->period = LATENCY_PERIOD_SEC * (size_t)dev.clock_rate;
+    p->len = len;
+    p->rec = pj_pool_calloc(pool, len, sizeof(pj_int16_t));
+    p->base.get_frame = &probe_get_frame;
+    p->base.put_frame = &probe_put_frame;
+
+    if(port_add(pool, &p->base, &p->slot) != 0) return 1;
+    pjsua_conf_connect(p->slot, call_slot);
+    pjsua_conf_connect(call_slot, p->slot);
+    probe = p;
+    return 0;
+}
+
+static void probe_stop(void){
+    if(!probe) return;
+    port_remove(&probe->base, probe->slot);
+    probe = NULL;
+}
+
+/* Find the round trip delay of one burst, in samples, by cross-correlating
+   the recording against the MLS.  Returns -1 if there is no clear peak. */
+static long probe_find_lag(const probe_t *p, size_t burst){
+    size_t start = p->settle + burst * p->period;
+    size_t max_lag = LATENCY_MAX_LAG_SEC * (size_t)p->rate;
+    double best = 0;
+    double sum = 0;
+    size_t nlags = 0;
+    long best_lag = -1;
+    for(size_t lag = 0; lag <= max_lag; lag++){
+        if(start + lag + mls_samples > p->len) break;
+        const pj_int16_t *r = p->rec + start + lag;
+        double c = 0;
+        for(size_t i = 0; i < mls_samples; i++){
+            c += (mls_sample(i) > 0) ? r[i] : -r[i];
+        }
+        c = c < 0 ? -c : c;
+        sum += c;
+        nlags++;
+        if(c > best){
+            best = c;
+            best_lag = (long)lag;
+        }
+    }
+    // an mls correlation peak towers over everything else; demand that
+    if(!nlags || best < 8 * (sum / nlags)) return -1;
+    return best_lag;
+}
+
+
+// echo mode: tell the measuring instance about our half of the jitter buffers
+static void echo_stream_destroyed(pjmedia_stream *strm, unsigned stream_idx){
+    if(stream_idx != 0) return;
+    pjmedia_jb_state jb;
+    if(pjmedia_stream_get_stat_jbuf(strm, &jb) != PJ_SUCCESS) return;
+    // stdout is a pipe back to the measuring instance
+    printf("jb_avg_delay=%u\n", jb.avg_delay);
+    fflush(stdout);
+}
+
+
+static void on_stream_destroyed(
+    pjsua_call_id cid, pjmedia_stream *strm, unsigned stream_idx
+){
+    (void)cid;
+    #if USE_VAD
+    vad_stream_destroyed(strm, stream_idx);
+    #endif
+    if(mode == MODE_ECHO) echo_stream_destroyed(strm, stream_idx);
+}
+
+
+#if USE_TONES
+/* Local feedback tones.  tones.c holds loops that wav_reader precomputed at
+   the bridge clock rate, each a whole number of periods long, so a memory
+   player reading straight out of tones.c can loop them forever without
+   clicks, copies or any synthesis.  Only one tone plays at a time.
+   tone_play() returns a generation number, so a timer set up to stop one
+   tone won't cut off whatever replaced it.  All of the state below is
+   guarded by tone_lock, since it's touched from the SIP, media and timer
+   threads. */
+typedef struct {
+    pj_pool_t *pool;
+    pjmedia_port *port;
+    pjsua_conf_port_id slot;
+} tone_t;
+
+static pthread_mutex_t tone_lock = PTHREAD_MUTEX_INITIALIZER;
+static tone_t tone = { NULL, NULL, PJSUA_INVALID_ID };
+static unsigned tone_gen = 0;
+static bool ringback_on = false;
+
+static void tone_stop_locked(void){
+    ringback_on = false;
+    if(!tone.port) return;
+    // the player and its pool go away once the bridge is done with them
+    port_remove(tone.port, tone.slot);
+    tone.pool = NULL;
+    tone.port = NULL;
+}
+
+static unsigned tone_play_locked(const unsigned char *data, unsigned samples){
+    tone_stop_locked();
+    unsigned gen = ++tone_gen;
+
+    pjsua_conf_port_info dev;
+    pj_status_t pret = pjsua_conf_get_port_info(0, &dev);
+    if(pret != PJ_SUCCESS) goto fail;
+    pj_pool_t *pool = pjsua_pool_create("tone", 512, 512);
+    if(!pool) goto fail;
+    pjmedia_port *port;
+    pret = pjmedia_mem_player_create(
+        pool,
+        (void*)data,
+        samples * sizeof(pj_int16_t),
+        tones_hz,
+        1, // channel_count
+        dev.samples_per_frame,
+        16, // bits_per_sample
+        0, // options: loop forever
+        &port
+    );
+    if(pret != PJ_SUCCESS){
+        pj_pool_release(pool);
+        goto fail;
+    }
+    // on failure, this releases the pool
+    if(port_add(pool, port, &tone.slot) != 0) goto fail;
+    tone.pool = pool;
+    tone.port = port;
+    pjsua_conf_connect(tone.slot, 0);
+    return gen;
+
+fail:
+    log_printf("failed to play tone\n");
+    return gen;
+}
+
+// loop some of tones.c on the speaker, until tone_stop()
+static unsigned tone_play(const unsigned char *data, unsigned samples){
+    pthread_mutex_lock(&tone_lock);
+    unsigned gen = tone_play_locked(data, samples);
+    pthread_mutex_unlock(&tone_lock);
+    return gen;
+}
+
+// stop tone number gen, if it's still playing; gen 0 stops any tone
+static void tone_stop(unsigned gen){
+    pthread_mutex_lock(&tone_lock);
+    if(!gen || gen == tone_gen) tone_stop_locked();
+    pthread_mutex_unlock(&tone_lock);
+}
+
+static void tone_timer_cb(void *user_data){
+    tone_stop((unsigned)(uintptr_t)user_data);
+}
+
+// play a digit's sidetone for DTMF_SIDETONE_MS
+static void tone_sidetone(char digit){
+    size_t ntones = sizeof(tone_dtmf)/sizeof(*tone_dtmf);
+    for(size_t i = 0; i < ntones; i++){
+        if(tone_dtmf[i].digit != digit) continue;
+        unsigned gen = tone_play(tone_dtmf[i].data, tone_dtmf[i].samples);
+        pj_status_t pret = pjsua_schedule_timer2(
+            tone_timer_cb, (void*)(uintptr_t)gen, DTMF_SIDETONE_MS
+        );
+        // better no sidetone than one that never ends
+        if(pret != PJ_SUCCESS) tone_stop(gen);
+        return;
+    }
+}
+
+static void tone_ringback_start(void){
+    pthread_mutex_lock(&tone_lock);
+    if(!ringback_on){
+        tone_play_locked(tone_ringback, tone_ringback_samples);
+        ringback_on = tone.port != NULL;
+    }
+    pthread_mutex_unlock(&tone_lock);
+}
+
+// stop the ringback, but leave any other tone alone
+static void tone_ringback_stop(void){
+    pthread_mutex_lock(&tone_lock);
+    if(ringback_on) tone_stop_locked();
+    pthread_mutex_unlock(&tone_lock);
+}
+#endif // USE_TONES
+
 
 // connect to media when it opens
 static void on_call_media_state(pjsua_call_id cid){
@@ -125,19 +990,427 @@ static void on_call_media_state(pjsua_call_id cid){
     pjsua_call_get_info(cid, &ci);
 
     if(ci.media_status == PJSUA_CALL_MEDIA_ACTIVE) {
+        #if USE_TONES
+        // with early media, the far end plays its own ringback
+        tone_ringback_stop();
+        #endif
+        if(mode == MODE_ECHO){
+            // everything we hear goes right back
+            pjsua_conf_connect(ci.conf_slot, ci.conf_slot);
+            return;
+        }
+        if(mode == MODE_LATENCY){
+            if(!probe && probe_start(ci.conf_slot) != 0){
+                log_printf("failed to start latency probe, hanging up\n");
+                pjsua_call_hangup(cid, 0, NULL, NULL);
+            }
+            return;
+        }
         // When media is active, connect call to sound device.
-        pjsua_conf_connect(ci.conf_slot, 0);
-        pjsua_conf_connect(0, ci.conf_slot);
+        pjsua_conf_port_id dev = 0;
+        #ifdef AUDIO_SOCKET_PATH
+        // ...which is the audio socket, in this mode
+        if(!pcm_sock && pcm_sock_start(cid) != 0){
+            log_printf("failed to connect audio socket, hanging up\n");
+            pjsua_call_hangup(cid, 0, NULL, NULL);
+            return;
+        }
+        dev = pcm_sock->slot;
+        #endif
+        pjsua_conf_connect(ci.conf_slot, dev);
+        #if USE_VAD
+        // the microphone reaches the call through the vad gate, if we can
+        if(vad_gate) return;
+        if(vad_start(dev, ci.conf_slot) == 0) return;
+        log_printf("failed to start vad, sending all audio\n");
+        #endif
+        pjsua_conf_connect(dev, ci.conf_slot);
+    }
+}
+
+
+#ifdef STUN_SERVERS
+// report what pjsua's own NAT type detection learned, once STUN resolves
+static void on_nat_detect(const pj_stun_nat_detect_result *res){
+    if(res->status != PJ_SUCCESS){
+        log_printf("NAT detection failed\n");
+        return;
     }
+    log_printf("NAT type: %s\n", res->nat_type_name);
+}
+#endif // STUN_SERVERS
+
+
+#if USE_ICE
+/* pjsua only starts gathering ICE candidates once a call has a media
+   transport, so every offer waits for STUN (and a TURN allocation, with
+   TURN_SERVER) before it can be sent.  Instead, we keep one ICE transport
+   gathered ahead of time: the first right after registration, and each
+   next one as soon as a call takes the last.  While it waits, the spare's
+   STUN keep-alives and TURN refreshes keep its bindings fresh.
+
+   pjsua's own ICE is off, so the transport it creates for a call is a
+   plain UDP one that costs nothing to set up.  on_create_media_transport
+   swaps the spare in, behind a thin adapter that also closes pjsua's
+   transport when the call is done, like pjsua asks.  If no spare is ready
+   (it's still gathering, or gathering failed), the call goes without ICE. */
+// longest an outgoing call waits for the first spare before dialing
+#define ICE_GATHER_WAIT_MS 5000
+
+typedef struct {
+    pjmedia_transport base;
+    pj_pool_t *pool;
+    // the ice transport, possibly wrapped in srtp
+    pjmedia_transport *inner;
+    // pjsua's own transport, which we replaced
+    pjmedia_transport *member;
+    bool close_member;
+} ice_tp_t;
+
+static pthread_mutex_t ice_lock = PTHREAD_MUTEX_INITIALIZER;
+static pjmedia_transport *ice_spare = NULL;
+// the spare's candidate gathering result; PJ_EPENDING until it finishes
+static pj_status_t ice_spare_status = PJ_EPENDING;
+static bool ice_gathering = false;
+// set by ice_stop(), so no new spare is started during shutdown
+static bool ice_stopped = false;
+#if USE_TLS
+// what reg_unreg() gave the account, so the spare can get the same srtp
+static pjsua_srtp_opt ice_srtp_opt;
+#endif
+
+static pj_status_t ice_tp_get_info(
+    pjmedia_transport *tp, pjmedia_transport_info *info
+){
+    return pjmedia_transport_get_info(((ice_tp_t*)tp)->inner, info);
+}
+
+static pj_status_t ice_tp_attach(
+    pjmedia_transport *tp, void *user_data,
+    const pj_sockaddr_t *rem_addr, const pj_sockaddr_t *rem_rtcp,
+    unsigned addr_len,
+    void (*rtp_cb)(void*, void*, pj_ssize_t),
+    void (*rtcp_cb)(void*, void*, pj_ssize_t)
+){
+    return pjmedia_transport_attach(
+        ((ice_tp_t*)tp)->inner, user_data, rem_addr, rem_rtcp, addr_len,
+        rtp_cb, rtcp_cb
+    );
+}
+
+static pj_status_t ice_tp_attach2(
+    pjmedia_transport *tp, pjmedia_transport_attach_param *param
+){
+    return pjmedia_transport_attach2(((ice_tp_t*)tp)->inner, param);
+}
+
+static void ice_tp_detach(pjmedia_transport *tp, void *user_data){
+    pjmedia_transport_detach(((ice_tp_t*)tp)->inner, user_data);
+}
+
+static pj_status_t ice_tp_send_rtp(
+    pjmedia_transport *tp, const void *pkt, pj_size_t size
+){
+    return pjmedia_transport_send_rtp(((ice_tp_t*)tp)->inner, pkt, size);
+}
+
+static pj_status_t ice_tp_send_rtcp(
+    pjmedia_transport *tp, const void *pkt, pj_size_t size
+){
+    return pjmedia_transport_send_rtcp(((ice_tp_t*)tp)->inner, pkt, size);
 }
 
+static pj_status_t ice_tp_send_rtcp2(
+    pjmedia_transport *tp, const pj_sockaddr_t *addr, unsigned addr_len,
+    const void *pkt, pj_size_t size
+){
+    return pjmedia_transport_send_rtcp2(
+        ((ice_tp_t*)tp)->inner, addr, addr_len, pkt, size
+    );
+}
+
+static pj_status_t ice_tp_media_create(
+    pjmedia_transport *tp, pj_pool_t *sdp_pool, unsigned options,
+    const pjmedia_sdp_session *rem_sdp, unsigned media_index
+){
+    return pjmedia_transport_media_create(
+        ((ice_tp_t*)tp)->inner, sdp_pool, options, rem_sdp, media_index
+    );
+}
+
+static pj_status_t ice_tp_encode_sdp(
+    pjmedia_transport *tp, pj_pool_t *sdp_pool,
+    pjmedia_sdp_session *sdp_local, const pjmedia_sdp_session *rem_sdp,
+    unsigned media_index
+){
+    return pjmedia_transport_encode_sdp(
+        ((ice_tp_t*)tp)->inner, sdp_pool, sdp_local, rem_sdp, media_index
+    );
+}
+
+static pj_status_t ice_tp_media_start(
+    pjmedia_transport *tp, pj_pool_t *tmp_pool,
+    const pjmedia_sdp_session *sdp_local,
+    const pjmedia_sdp_session *sdp_remote, unsigned media_index
+){
+    return pjmedia_transport_media_start(
+        ((ice_tp_t*)tp)->inner, tmp_pool, sdp_local, sdp_remote, media_index
+    );
+}
+
+static pj_status_t ice_tp_media_stop(pjmedia_transport *tp){
+    return pjmedia_transport_media_stop(((ice_tp_t*)tp)->inner);
+}
+
+static pj_status_t ice_tp_simulate_lost(
+    pjmedia_transport *tp, pjmedia_dir dir, unsigned pct_lost
+){
+    return pjmedia_transport_simulate_lost(
+        ((ice_tp_t*)tp)->inner, dir, pct_lost
+    );
+}
+
+static pj_status_t ice_tp_destroy(pjmedia_transport *tp){
+    ice_tp_t *t = (ice_tp_t*)tp;
+    pjmedia_transport_close(t->inner);
+    if(t->close_member) pjmedia_transport_close(t->member);
+    pj_pool_release(t->pool);
+    return PJ_SUCCESS;
+}
+
+static struct pjmedia_transport_op ice_tp_op = {
+    .get_info = &ice_tp_get_info,
+    .attach = &ice_tp_attach,
+    .detach = &ice_tp_detach,
+    .send_rtp = &ice_tp_send_rtp,
+    .send_rtcp = &ice_tp_send_rtcp,
+    .send_rtcp2 = &ice_tp_send_rtcp2,
+    .media_create = &ice_tp_media_create,
+    .encode_sdp = &ice_tp_encode_sdp,
+    .media_start = &ice_tp_media_start,
+    .media_stop = &ice_tp_media_stop,
+    .simulate_lost = &ice_tp_simulate_lost,
+    .destroy = &ice_tp_destroy,
+    .attach2 = &ice_tp_attach2,
+};
+
+static void ice_on_complete(
+    pjmedia_transport *tp, pj_ice_strans_op op, pj_status_t status
+){
+    if(op == PJ_ICE_STRANS_OP_NEGOTIATION){
+        log_printf(
+            "ICE negotiation %s\n", status == PJ_SUCCESS ? "done" : "failed"
+        );
+        return;
+    }
+    if(op != PJ_ICE_STRANS_OP_INIT) return;
+    if(status != PJ_SUCCESS) log_printf("ICE candidate gathering failed\n");
+    pthread_mutex_lock(&ice_lock);
+    // ice_spare is still NULL if this finished inside pjmedia_ice_create3()
+    if(tp == ice_spare || !ice_spare) ice_spare_status = status;
+    pthread_mutex_unlock(&ice_lock);
+}
+
+// split "host:port" into host and port, defaulting to the usual STUN port
+static pj_uint16_t ice_server(const char *spec, pj_str_t *host){
+    const char *colon = strrchr(spec, ':');
+    host->ptr = (char*)spec;
+    host->slen = colon ? colon - spec : (pj_ssize_t)strlen(spec);
+    if(!colon) return PJ_STUN_PORT;
+    pj_str_t port = pj_str((char*)colon + 1);
+    return (pj_uint16_t)pj_strtoul(&port);
+}
+
+// start gathering candidates for a new spare, unless one already exists
+static void ice_gather(void){
+    pthread_mutex_lock(&ice_lock);
+    bool busy = ice_spare || ice_gathering || ice_stopped;
+    if(!busy){
+        ice_gathering = true;
+        ice_spare_status = PJ_EPENDING;
+    }
+    pthread_mutex_unlock(&ice_lock);
+    if(busy) return;
+
+    pjsip_endpoint *endpt = pjsua_get_pjsip_endpt();
+    pj_ice_strans_cfg cfg;
+    pj_ice_strans_cfg_default(&cfg);
+    pj_stun_config_init(
+        &cfg.stun_cfg,
+        pjsua_get_pool_factory(),
+        0, // options
+        pjsip_endpt_get_ioqueue(endpt),
+        pjsip_endpt_get_timer_heap(endpt)
+    );
+    cfg.resolver = pjsip_endpt_get_resolver(endpt);
+    cfg.af = pj_AF_INET();
+
+    // host candidates come from here too, even without a stun server
+    cfg.stun_tp_cnt = 1;
+    pj_ice_strans_stun_cfg_default(&cfg.stun_tp[0]);
+    #ifdef STUN_SERVERS
+    static const char *stun_servers[] = STUN_SERVERS;
+    cfg.stun_tp[0].port = ice_server(stun_servers[0], &cfg.stun_tp[0].server);
+    #endif
+
+    #ifdef TURN_SERVER
+    cfg.turn_tp_cnt = 1;
+    pj_ice_strans_turn_cfg_default(&cfg.turn_tp[0]);
+    cfg.turn_tp[0].port = ice_server(TURN_SERVER, &cfg.turn_tp[0].server);
+    cfg.turn_tp[0].conn_type = TURN_CONN_TYPE;
+    pj_stun_auth_cred *cred = &cfg.turn_tp[0].auth_cred;
+    cred->type = PJ_STUN_AUTH_CRED_STATIC;
+    cred->data.static_cred.realm = pj_str(TURN_REALM);
+    cred->data.static_cred.username = pj_str(TURN_USERNAME);
+    cred->data.static_cred.data_type = PJ_STUN_PASSWD_PLAIN;
+    cred->data.static_cred.data = pj_str(TURN_PASSWORD);
+    #endif
+
+    pjmedia_ice_cb cb = { .on_ice_complete = &ice_on_complete };
+    pjmedia_transport *tp = NULL;
+    pj_status_t pret = pjmedia_ice_create3(
+        pjsua_get_pjmedia_endpt(),
+        "ice",
+        2, // components: rtp and rtcp
+        &cfg,
+        &cb,
+        0, // options
+        NULL, // user_data
+        &tp
+    );
+    if(pret != PJ_SUCCESS){
+        log_printf("failed to start ICE candidate gathering\n");
+        tp = NULL;
+    }
+
+    pthread_mutex_lock(&ice_lock);
+    ice_spare = tp;
+    ice_gathering = false;
+    pthread_mutex_unlock(&ice_lock);
+}
+
+/* Wait until the spare is gathered, or has failed, or ICE_GATHER_WAIT_MS is
+   up.  pjsua would wait for gathering before sending an offer too; this
+   way, the wait overlaps with registration. */
+static void ice_wait(void){
+    for(unsigned ms = 0; ms < ICE_GATHER_WAIT_MS; ms += 10){
+        pthread_mutex_lock(&ice_lock);
+        bool waiting = ice_gathering
+            || (ice_spare && ice_spare_status == PJ_EPENDING);
+        pthread_mutex_unlock(&ice_lock);
+        if(!waiting) return;
+        usleep(10000);
+    }
+    log_printf("ICE candidate gathering is slow, not waiting for it\n");
+}
+
+// close the spare, if any; call before pjsua_destroy()
+static void ice_stop(void){
+    pthread_mutex_lock(&ice_lock);
+    ice_stopped = true;
+    // let a spare that's being created right now land in ice_spare
+    while(ice_gathering){
+        pthread_mutex_unlock(&ice_lock);
+        usleep(1000);
+        pthread_mutex_lock(&ice_lock);
+    }
+    pjmedia_transport *tp = ice_spare;
+    ice_spare = NULL;
+    pthread_mutex_unlock(&ice_lock);
+    if(tp) pjmedia_transport_close(tp);
+}
+
+#if USE_TLS && defined(PJMEDIA_HAS_SRTP) && PJMEDIA_HAS_SRTP
+// wrap the spare in srtp, the way pjsua would have for its own transport
+static pjmedia_transport *ice_wrap_srtp(pjmedia_transport *ice){
+    if(USE_SRTP == PJMEDIA_SRTP_DISABLED) return ice;
+    pjmedia_srtp_setting opt;
+    pjmedia_srtp_setting_default(&opt);
+    opt.use = USE_SRTP;
+    opt.close_member_tp = PJ_TRUE;
+    if(ice_srtp_opt.crypto_count){
+        opt.crypto_count = ice_srtp_opt.crypto_count;
+        for(unsigned i = 0; i < opt.crypto_count; i++){
+            opt.crypto[i] = ice_srtp_opt.crypto[i];
+        }
+    }
+    if(ice_srtp_opt.keying_count){
+        opt.keying_count = ice_srtp_opt.keying_count;
+        for(unsigned i = 0; i < opt.keying_count; i++){
+            opt.keying[i] = ice_srtp_opt.keying[i];
+        }
+    }
+    pjmedia_transport *srtp;
+    pj_status_t pret = pjmedia_transport_srtp_create(
+        pjsua_get_pjmedia_endpt(), ice, &opt, &srtp
+    );
+    if(pret != PJ_SUCCESS) return NULL;
+    return srtp;
+}
+#endif
+
+// hand the gathered spare to a new call, in place of pjsua's transport
+static pjmedia_transport *on_create_media_transport(
+    pjsua_call_id cid, unsigned media_idx, pjmedia_transport *base_tp,
+    unsigned flags
+){
+    (void)cid;
+    if(media_idx != 0) return base_tp;
+
+    pthread_mutex_lock(&ice_lock);
+    pjmedia_transport *ice = NULL;
+    pjmedia_transport *failed = NULL;
+    if(ice_spare && ice_spare_status == PJ_SUCCESS) ice = ice_spare;
+    else if(ice_spare && ice_spare_status != PJ_EPENDING) failed = ice_spare;
+    if(ice || failed) ice_spare = NULL;
+    pthread_mutex_unlock(&ice_lock);
+
+    // either way, start on the spare for the call after this one
+    if(failed) pjmedia_transport_close(failed);
+    ice_gather();
+
+    if(!ice){
+        log_printf("no ICE candidates gathered yet, calling without ICE\n");
+        return base_tp;
+    }
+
+    pjmedia_transport *inner = ice;
+    #if USE_TLS && defined(PJMEDIA_HAS_SRTP) && PJMEDIA_HAS_SRTP
+    inner = ice_wrap_srtp(ice);
+    if(!inner){
+        log_printf("failed to set up SRTP over ICE, calling without ICE\n");
+        pjmedia_transport_close(ice);
+        return base_tp;
+    }
+    #endif
+
+    pj_pool_t *pool = pjsua_pool_create("icetp", 512, 512);
+    if(!pool){
+        pjmedia_transport_close(inner);
+        return base_tp;
+    }
+    ice_tp_t *t = PJ_POOL_ZALLOC_T(pool, ice_tp_t);
+    pj_ansi_strncpy(t->base.name, "icetp", sizeof(t->base.name) - 1);
+    t->base.type = PJMEDIA_TRANSPORT_TYPE_USER;
+    t->base.op = &ice_tp_op;
+    t->pool = pool;
+    t->inner = inner;
+    t->member = base_tp;
+    t->close_member = (flags & PJSUA_MED_TP_CLOSE_MEMBER) != 0;
+    return &t->base;
+}
+#endif // USE_ICE
+
 
 static bool should_cont = true;
 static bool soft_kill = true;
 // the second time through this function it will just hard-exit the program
 static void sigint_handler(int signum){
     if(soft_kill){
-        fprintf(stderr, "catching signal, exiting\n");
+        // not the async logger: its rings aren't safe to use from a handler
+        static const char msg[] = "catching signal, exiting\n";
+        ssize_t zret = write(2, msg, sizeof(msg) - 1);
+        (void)zret;
         should_cont = false;
         soft_kill = false;
     }else{
@@ -146,6 +1419,46 @@ static void sigint_handler(int signum){
 }
 
 
+#if USE_TONES
+// let the busy signal play for a bit before we exit
+static void busy_done_cb(void *user_data){
+    tone_stop((unsigned)(uintptr_t)user_data);
+    should_cont = false;
+}
+
+// ringback while an outgoing call is ringing, busy if it was busy
+static bool call_tones(const pjsua_call_info *ci){
+    if(mode != MODE_CALL || ci->role != PJSIP_ROLE_UAC) return false;
+    switch(ci->state){
+        case PJSIP_INV_STATE_CALLING:
+        case PJSIP_INV_STATE_EARLY:
+            if(ci->media_status != PJSUA_CALL_MEDIA_ACTIVE){
+                tone_ringback_start();
+            }
+            return false;
+        case PJSIP_INV_STATE_CONNECTING:
+        case PJSIP_INV_STATE_CONFIRMED:
+            tone_ringback_stop();
+            return false;
+        case PJSIP_INV_STATE_DISCONNECTED:
+            if(ci->last_status != PJSIP_SC_BUSY_HERE
+                && ci->last_status != PJSIP_SC_BUSY_EVERYWHERE){
+                tone_stop(0);
+                return false;
+            }
+            unsigned gen = tone_play(tone_busy, tone_busy_samples);
+            pj_status_t pret = pjsua_schedule_timer2(
+                busy_done_cb, (void*)(uintptr_t)gen, BUSY_TONE_MS
+            );
+            // busy_done_cb will end the program
+            return pret == PJ_SUCCESS;
+        default:
+            return false;
+    }
+}
+#endif // USE_TONES
+
+
 // exit automatically if call disconnects
 static bool external_disconnect = false;
 static void on_call_state(pjsua_call_id cid, pjsip_event *e){
@@ -164,15 +1477,35 @@ static void on_call_state(pjsua_call_id cid, pjsip_event *e){
         case PJSIP_INV_STATE_DISCONNECTED: state="DISCONNECTED"; break;
     }
     #define FMT_PJSTR(x) (int)(x).slen, (x).ptr
-    fprintf(stderr,
+    log_printf(
         "call state: %s: \"%.*s\"\n",
         state, FMT_PJSTR(ci.last_status_text)
     );
+    // the same thing, in a form that is easy to process later
+    struct {
+        int32_t call_id;
+        int32_t state;
+        int32_t last_status;
+    } rec = { cid, ci.state, ci.last_status };
+    log_binary(LOG_REC_CALL_STATE, &rec, sizeof(rec));
+    bool delay_exit = false;
+    #if USE_TONES
+    delay_exit = call_tones(&ci);
+    #endif
     // if disconnected, end the program
     if(ci.state == PJSIP_INV_STATE_DISCONNECTED){
         pjsua_conf_disconnect(ci.conf_slot, 0);
         pjsua_conf_disconnect(0, ci.conf_slot);
-        should_cont = false;
+        #if USE_VAD
+        vad_stop(cid);
+        #endif
+        #ifdef AUDIO_SOCKET_PATH
+        pcm_sock_stop();
+        #endif
+        if(mode == MODE_ECHO){
+            pjsua_conf_disconnect(ci.conf_slot, ci.conf_slot);
+        }
+        if(!delay_exit) should_cont = false;
         external_disconnect = true;
     }
 }
@@ -187,9 +1520,23 @@ int dial_number(pjsip_globals_t *pg){
         SIP_URL_SPRINTF_ARGS(pg->phone_number)
     );
     if(sip_len > sizeof(sip_url)-1 || sip_len < 0){
-        fprintf(stderr, "error during sprintf\n");
+        log_printf("error during sprintf\n");
         return 50;
     }
+    #if RACE_TRANSPORTS
+    // dial over the same path that won the registration race
+    int param_len = snprintf(
+        sip_url + sip_len,
+        sizeof(sip_url) - sip_len,
+        "%s",
+        pg->path->uri_param
+    );
+    if(param_len > sizeof(sip_url)-1 - sip_len || param_len < 0){
+        log_printf("error during sprintf\n");
+        return 50;
+    }
+    sip_len += param_len;
+    #endif
     pj_str_t pj_sip_url = {.ptr=sip_url, .slen=sip_len};
     pjsua_call_setting cs;
     pjsua_call_setting_default(&cs);
@@ -203,6 +1550,162 @@ int dial_number(pjsip_globals_t *pg){
 }
 
 
+#if RACE_TRANSPORTS
+// where we remember which path won the last race
+static int race_state_path(char *out, size_t cap){
+    #ifdef RACE_STATE_PATH
+    int n = snprintf(out, cap, "%s", RACE_STATE_PATH);
+    #else
+    const char *home = getenv("HOME");
+    if(!home) return -1;
+    // make sure ~/.cache exists; a failure here shows up when we write
+    int n = snprintf(out, cap, "%s/.cache", home);
+    if(n < 0 || (size_t)n >= cap) return -1;
+    mkdir(out, 0700);
+    n = snprintf(out, cap, "%s/.cache/call-transport", home);
+    #endif
+    if(n < 0 || (size_t)n >= cap) return -1;
+    return 0;
+}
+
+// returns the index of last run's winner, or -1 if we don't know it
+static int race_load_winner(void){
+    char path[4096];
+    if(race_state_path(path, sizeof(path))) return -1;
+    FILE *f = fopen(path, "r");
+    if(!f) return -1;
+    char name[32] = {0};
+    char *got = fgets(name, sizeof(name), f);
+    fclose(f);
+    if(!got) return -1;
+    name[strcspn(name, "\n")] = '\0';
+    for(size_t i = 0; i < RACE_NPATHS; i++){
+        if(strcmp(race_paths[i].name, name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static void race_save_winner(size_t idx){
+    char path[4096];
+    if(race_state_path(path, sizeof(path))) return;
+    FILE *f = fopen(path, "w");
+    if(!f){
+        log_printf("%s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(f, "%s\n", race_paths[idx].name);
+    if(fclose(f)){
+        log_printf("%s: %s\n", path, strerror(errno));
+    }
+}
+
+static uint64_t race_now_ms(void){
+    pj_time_val tv;
+    pj_gettickcount(&tv);
+    return (uint64_t)PJ_TIME_VAL_MSEC(tv);
+}
+
+/* Happy eyeballs for registration: register one account per path, starting
+   a new path every RACE_STAGGER_MS (or right away, if every path so far has
+   failed), and keep whichever registers first.  Last run's winner goes
+   first, so on a stable network the race is usually over before the second
+   path even starts. */
+static int race_register(pjsip_globals_t *pg, const pjsua_acc_config *base){
+    size_t order[RACE_NPATHS];
+    size_t norder = 0;
+    int last = race_load_winner();
+    if(last >= 0 && pg->tids[last] != PJSUA_INVALID_ID){
+        order[norder++] = (size_t)last;
+    }
+    for(size_t i = 0; i < RACE_NPATHS; i++){
+        if((int)i == last || pg->tids[i] == PJSUA_INVALID_ID) continue;
+        order[norder++] = i;
+    }
+
+    static char reg_uris[RACE_NPATHS][1024];
+    pjsua_acc_id aids[RACE_NPATHS];
+    for(size_t i = 0; i < RACE_NPATHS; i++) aids[i] = PJSUA_INVALID_ID;
+
+    int winner = -1;
+    size_t started = 0;
+    uint64_t t0 = race_now_ms();
+    uint64_t next_start = t0;
+    while(should_cont){
+        uint64_t now = race_now_ms();
+
+        // start the next path, if it's time
+        if(started < norder && now >= next_start){
+            size_t i = order[started++];
+            next_start = now + RACE_STAGGER_MS;
+            pjsua_acc_config ac = *base;
+            int n = snprintf(
+                reg_uris[i], sizeof(reg_uris[i]),
+                "%s%s", REGISTER_URI, race_paths[i].uri_param
+            );
+            if(n < 0 || (size_t)n >= sizeof(reg_uris[i])){
+                log_printf("error during sprintf\n");
+                continue;
+            }
+            ac.reg_uri = pj_str(reg_uris[i]);
+            ac.transport_id = pg->tids[i];
+            if(race_paths[i].ipv6){
+                ac.ipv6_sip_use = PJSUA_IPV6_ENABLED_USE_IPV6_ONLY;
+                ac.ipv6_media_use = PJSUA_IPV6_ENABLED_USE_IPV6_ONLY;
+            }
+            pj_status_t pret = pjsua_acc_add(&ac, PJ_FALSE, &aids[i]);
+            if(pret != PJ_SUCCESS){
+                log_printf("failed to start %s\n", race_paths[i].name);
+                aids[i] = PJSUA_INVALID_ID;
+            }else{
+                log_printf("registering over %s\n", race_paths[i].name);
+            }
+        }
+
+        // check on every path we've started
+        size_t failed = 0;
+        for(size_t k = 0; k < started && winner < 0; k++){
+            size_t i = order[k];
+            if(aids[i] == PJSUA_INVALID_ID){
+                failed++;
+                continue;
+            }
+            pjsua_acc_info ai;
+            if(pjsua_acc_get_info(aids[i], &ai) != PJ_SUCCESS) continue;
+            if(ai.status == PJSIP_SC_OK && ai.expires > 0){
+                winner = (int)i;
+            }else if(ai.status >= 300){
+                failed++;
+            }
+        }
+        if(winner >= 0) break;
+        if(failed == norder) break;
+        // a dead path shouldn't hold up the next one
+        if(failed == started) next_start = now;
+        if(now - t0 > RACE_TIMEOUT_MS) break;
+
+        usleep(10000);
+    }
+
+    // the losers unregister, so calls can only come in over the winner
+    for(size_t i = 0; i < RACE_NPATHS; i++){
+        if(aids[i] == PJSUA_INVALID_ID || (int)i == winner) continue;
+        pjsua_acc_del(aids[i]);
+    }
+    if(winner < 0){
+        log_printf("failed to register over any transport\n");
+        return 40;
+    }
+
+    log_printf("registered over %s\n", race_paths[winner].name);
+    pjsua_acc_set_default(aids[winner]);
+    pg->aid = aids[winner];
+    pg->path = &race_paths[winner];
+    race_save_winner((size_t)winner);
+    return 0;
+}
+#endif // RACE_TRANSPORTS
+
+
 int reg_unreg(pjsip_globals_t *pg){
     int retval = 0;
 
@@ -226,22 +1729,76 @@ int reg_unreg(pjsip_globals_t *pg){
 
     #if USE_TLS
     ac.use_srtp = USE_SRTP;
+    #ifdef SRTP_CRYPTO_SUITES
+    // offer only the configured srtp suites, in order of preference
+    char *suites[] = SRTP_CRYPTO_SUITES;
+    size_t nsuites = sizeof(suites)/sizeof(*suites);
+    if(nsuites > PJ_ARRAY_SIZE(ac.srtp_opt.crypto)){
+        log_printf(
+            "too many SRTP_CRYPTO_SUITES (max %u)\n",
+            (unsigned)PJ_ARRAY_SIZE(ac.srtp_opt.crypto)
+        );
+        return 42;
+    }
+    /* pjmedia rejects a suite it doesn't know, which would fail every call's
+       media, and which suites it knows depends on how pjproject and libsrtp
+       were built.  So skip the ones this build lacks. */
+    pjmedia_srtp_crypto known[PJ_ARRAY_SIZE(ac.srtp_opt.crypto)];
+    unsigned nknown = PJ_ARRAY_SIZE(known);
+    pj_status_t eret = pjmedia_srtp_enum_crypto(&nknown, known);
+    if(eret != PJ_SUCCESS){
+        log_printf("failed to list supported SRTP crypto suites\n");
+        return 42;
+    }
+    unsigned count = 0;
+    for(size_t i = 0; i < nsuites; i++){
+        pj_str_t name = pj_str(suites[i]);
+        bool supported = false;
+        for(unsigned j = 0; j < nknown; j++){
+            if(pj_stricmp(&name, &known[j].name) == 0) supported = true;
+        }
+        if(!supported){
+            log_printf(
+                "SRTP crypto suite %s is not supported, skipping\n", suites[i]
+            );
+            continue;
+        }
+        pj_bzero(&ac.srtp_opt.crypto[count], sizeof(ac.srtp_opt.crypto[count]));
+        // an empty key means pjmedia generates a fresh one per call
+        ac.srtp_opt.crypto[count].name = name;
+        count++;
+    }
+    if(count == 0){
+        log_printf("none of SRTP_CRYPTO_SUITES are supported\n");
+        return 43;
+    }
+    ac.srtp_opt.crypto_count = count;
+    #endif // SRTP_CRYPTO_SUITES
+    #if USE_ICE
+    ice_srtp_opt = ac.srtp_opt;
     #endif
+    #endif // USE_TLS
 
     // create the account
+    pj_status_t pret;
+    #if RACE_TRANSPORTS
+    retval = race_register(pg, &ac);
+    if(retval) return retval;
+    #else // not RACE_TRANSPORTS
     int make_default = 1;
-    pj_status_t pret = pjsua_acc_add(&ac, make_default, &pg->aid);
+    pret = pjsua_acc_add(&ac, make_default, &pg->aid);
     if(pret != PJ_SUCCESS){
         //psjua_perror("sender", "title", pret);
         return 40;
     }
+    #endif // RACE_TRANSPORTS
 
     // prepare the terminal
     struct termios old_tios;
     // store terminal settings
     int ret = tcgetattr(0, &old_tios);
     if(ret != 0){
-        perror("tcgetattr");
+        log_printf("tcgetattr: %s\n", strerror(errno));
         exit(1);
     }
 
@@ -250,12 +1807,20 @@ int reg_unreg(pjsip_globals_t *pg){
     new_tios.c_lflag &= ~(ICANON | ECHO);
     ret = tcsetattr(0, TCSANOW, &new_tios);
     if(ret != 0){
-        perror("tcsetattr");
+        log_printf("tcsetattr: %s\n", strerror(errno));
         return 41;
     }
 
+    #if USE_ICE
+    // registered; gather candidates for the first call now, not when it starts
+    ice_gather();
+    #endif
+
     // dial
     if(!pg->rx){
+        #if USE_ICE
+        ice_wait();
+        #endif
         retval = dial_number(pg);
         if(retval != 0) goto call_done;
     }
@@ -270,7 +1835,7 @@ int reg_unreg(pjsip_globals_t *pg){
         int ret = select(1, &rfds, NULL, NULL, &timeout);
         if(ret == -1) {
             if(errno == EINTR) continue;
-            perror("select");
+            log_printf("select: %s\n", strerror(errno));
             retval == 44;
             goto call_done;
         }
@@ -286,14 +1851,14 @@ int reg_unreg(pjsip_globals_t *pg){
             if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK){
                 continue;
             }
-            perror("read from stdin");
+            log_printf("read from stdin: %s\n", strerror(errno));
             retval = 45;
             goto call_done;
         }
 
         // make sure we got a digit
         if(!(c >= '0' && c <= '9') && c != '#' && c != '*'){
-            fprintf(stderr, "invalid dtmf character: %c\r\n", c);
+            log_printf("invalid dtmf character: %c\n", c);
             continue;
         }
 
@@ -303,6 +1868,10 @@ int reg_unreg(pjsip_globals_t *pg){
             pj_str_t digit = {.ptr=&c, .slen=1};
             pjsua_call_id call_id = pg->rx ? rx_call_id : pg->cid;
             pret = pjsua_call_dial_dtmf(call_id, &digit);
+            #if USE_TONES
+            // and let us hear it too
+            if(pret == PJ_SUCCESS) tone_sidetone(c);
+            #endif
         }
     }
 
@@ -313,9 +1882,15 @@ int reg_unreg(pjsip_globals_t *pg){
     }
 
 call_done:
+    #if USE_TONES
+    tone_stop(0);
+    #endif
+    #if USE_ICE
+    ice_stop();
+    #endif
     ret = tcsetattr(0, TCSANOW, &old_tios);
     if(ret != 0){
-        perror("tcsetattr");
+        log_printf("tcsetattr: %s\n", strerror(errno));
         return 46;
     }
 
@@ -327,6 +1902,289 @@ call_done:
     return retval;
 }
 
+// latency modes: only PCMU, so nothing is resampled or heavily compressed
+int latency_codecs(void){
+    pjsua_codec_info codecs[64];
+    unsigned count = PJ_ARRAY_SIZE(codecs);
+    pj_status_t pret = pjsua_enum_codecs(codecs, &count);
+    if(pret != PJ_SUCCESS) return 1;
+    for(unsigned i = 0; i < count; i++){
+        bool pcmu = pj_strncmp2(&codecs[i].codec_id, "PCMU/", 5) == 0;
+        pret = pjsua_codec_set_priority(
+            &codecs[i].codec_id,
+            pcmu ? PJMEDIA_CODEC_PRIO_HIGHEST : PJMEDIA_CODEC_PRIO_DISABLED
+        );
+        if(pret != PJ_SUCCESS) return 1;
+    }
+    return 0;
+}
+
+
+// latency modes: an account that never registers, with media on loopback
+int latency_account(pjsip_globals_t *pg, char *id){
+    pjsua_transport_id tids[1];
+    unsigned ntids = 1;
+    pj_status_t pret = pjsua_enum_transports(tids, &ntids);
+    if(pret != PJ_SUCCESS || ntids < 1) return 1;
+    pjsua_acc_config ac;
+    pjsua_acc_config_default(&ac);
+    ac.id = pj_str(id);
+    ac.transport_id = tids[0];
+    ac.rtp_cfg.bound_addr = pj_str("127.0.0.1");
+    ac.use_srtp = PJMEDIA_SRTP_DISABLED;
+    pret = pjsua_acc_add(&ac, PJ_TRUE, &pg->aid);
+    if(pret != PJ_SUCCESS) return 1;
+    return 0;
+}
+
+
+// read one line from fd, waiting at most ms milliseconds for all of it
+int read_line(int fd, char *buf, size_t cap, int ms){
+    size_t len = 0;
+    pj_time_val start;
+    pj_gettickcount(&start);
+    while(len + 1 < cap){
+        pj_time_val now;
+        pj_gettickcount(&now);
+        PJ_TIME_VAL_SUB(now, start);
+        long left = ms - PJ_TIME_VAL_MSEC(now);
+        if(left <= 0) return -1;
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        struct timeval timeout = {
+            .tv_sec = left / 1000, .tv_usec = (left % 1000) * 1000
+        };
+        int ret = select(fd + 1, &rfds, NULL, NULL, &timeout);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(ret == 0) continue;
+        ssize_t zret = read(fd, buf + len, 1);
+        if(zret < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        // eof
+        if(zret == 0) return -1;
+        if(buf[len] == '\n') break;
+        len++;
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+
+// echo mode: answer one call from the measuring instance, loop its audio
+int echo_run(pjsip_globals_t *pg){
+    int ret = latency_account(pg, "sip:echo@127.0.0.1");
+    if(ret) return 61;
+
+    // tell the measuring instance where to call us
+    pjsua_transport_id tids[1];
+    unsigned ntids = 1;
+    pjsua_transport_info ti;
+    pj_status_t pret = pjsua_enum_transports(tids, &ntids);
+    if(pret != PJ_SUCCESS || ntids < 1) return 62;
+    pret = pjsua_transport_get_info(tids[0], &ti);
+    if(pret != PJ_SUCCESS) return 62;
+    printf("ready port=%d\n", ti.local_name.port);
+    fflush(stdout);
+
+    // wait for the call to come and go, but don't outlive a stuck parent
+    for(unsigned waited = 0; should_cont; waited++){
+        if(!in_call && waited > 100) break;
+        if(getppid() == 1) break;
+        usleep(100000);
+    }
+    if(in_call && should_cont){
+        pjsua_call_hangup(rx_call_id, 0, NULL, NULL);
+    }
+    return 0;
+}
+
+
+/* Latency mode: start an echo instance of ourselves, call it over loopback,
+   play the probe signal into the call and find it in what comes back.  The
+   delay is measured end to end, then split up using what pjmedia can tell
+   us about the network (RTCP round trip time) and both jitter buffers. */
+int latency_run(pjsip_globals_t *pg){
+    int retval = 0;
+    pid_t pid = -1;
+    int fds[2] = {-1, -1};
+
+    int ret = latency_account(pg, "sip:latency@127.0.0.1");
+    if(ret) return 61;
+
+    // the echo instance reports back through its stdout
+    ret = pipe(fds);
+    if(ret){
+        log_printf("pipe: %s\n", strerror(errno));
+        return 63;
+    }
+    pid = fork();
+    if(pid < 0){
+        log_printf("fork: %s\n", strerror(errno));
+        retval = 63;
+        goto cu;
+    }
+    if(pid == 0){
+        dup2(fds[1], 1);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/proc/self/exe", "call", "--echo", (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    fds[1] = -1;
+
+    char line[128];
+    unsigned port = 0;
+    ret = read_line(fds[0], line, sizeof(line), 5000);
+    if(ret || sscanf(line, "ready port=%u", &port) != 1 || !port){
+        log_printf("echo instance failed to start\n");
+        retval = 64;
+        goto cu;
+    }
+    pg->echo_port = (unsigned short)port;
+
+    // call the echo instance
+    char sip_url[64];
+    int sip_len = snprintf(
+        sip_url, sizeof(sip_url), "sip:echo@127.0.0.1:%u", port
+    );
+    pj_str_t pj_sip_url = {.ptr=sip_url, .slen=sip_len};
+    pjsua_call_setting cs;
+    pjsua_call_setting_default(&cs);
+    pj_status_t pret = pjsua_call_make_call(
+        pg->aid, &pj_sip_url, &cs, NULL, NULL, &pg->cid
+    );
+    if(pret != PJ_SUCCESS){
+        log_printf("failed to call echo instance\n");
+        retval = 65;
+        goto cu;
+    }
+
+    // wait for the probe to finish recording
+    unsigned limit = (
+        LATENCY_SETTLE_SEC + LATENCY_PERIOD_SEC * LATENCY_BURSTS + 10
+    ) * 100;
+    for(unsigned i = 0; should_cont && !(probe && probe->done); i++){
+        if(i > limit) break;
+        usleep(10000);
+    }
+    if(!probe || !probe->done){
+        log_printf("latency probe did not finish\n");
+        retval = 66;
+        goto cu;
+    }
+
+    // our own stream stats, before the stream goes away
+    pjsua_stream_stat ss;
+    pret = pjsua_call_get_stream_stat(pg->cid, 0, &ss);
+    if(pret != PJ_SUCCESS){
+        log_printf("failed to get stream stats\n");
+        retval = 67;
+        goto cu;
+    }
+
+    pjsua_call_hangup(pg->cid, 0, NULL, NULL);
+
+    // the echo instance reports its jitter buffer as its stream is destroyed
+    unsigned echo_jb = 0;
+    bool have_echo_jb = false;
+    ret = read_line(fds[0], line, sizeof(line), 3000);
+    if(!ret && sscanf(line, "jb_avg_delay=%u", &echo_jb) == 1){
+        have_echo_jb = true;
+    }
+
+    // find each burst in the recording
+    double rtt_ms = 0, min_ms = 0, max_ms = 0;
+    unsigned found = 0;
+    for(size_t b = 0; b < LATENCY_BURSTS; b++){
+        long lag = probe_find_lag(probe, b);
+        if(lag < 0) continue;
+        double ms = lag * 1000.0 / probe->rate;
+        if(!found || ms < min_ms) min_ms = ms;
+        if(!found || ms > max_ms) max_ms = ms;
+        rtt_ms += ms;
+        found++;
+    }
+    if(!found){
+        log_printf("probe signal never came back\n");
+        retval = 68;
+        goto cu;
+    }
+    rtt_ms /= found;
+
+    printf("round trip: %.1f ms (min %.1f, max %.1f, %u of %u bursts)\n",
+        rtt_ms, min_ms, max_ms, found, LATENCY_BURSTS
+    );
+    printf("one way:    %.1f ms\n", rtt_ms / 2);
+    printf("round trip breakdown:\n");
+    double rest = rtt_ms;
+    if(ss.rtcp.rtt.n){
+        double net_ms = ss.rtcp.rtt.mean / 1000.0;
+        printf("  network:        %6.1f ms (rtcp rtt)\n", net_ms);
+        rest -= net_ms;
+    }else{
+        printf("  network:           n/a (no rtcp round trip yet)\n");
+    }
+    if(have_echo_jb){
+        unsigned jb_ms = ss.jbuf.avg_delay + echo_jb;
+        printf("  jitter buffers: %6u ms (ours %u, echo's %u)\n",
+            jb_ms, ss.jbuf.avg_delay, echo_jb
+        );
+        rest -= jb_ms;
+    }else{
+        printf("  jitter buffers:    n/a (ours %u ms, echo's unknown)\n",
+            ss.jbuf.avg_delay
+        );
+    }
+    printf(
+        "  sound devices:  %6.1f ms (null devices; a real one adds about"
+        " %u ms capture and %u ms playback per end)\n",
+        0.0, PJMEDIA_SND_DEFAULT_REC_LATENCY, PJMEDIA_SND_DEFAULT_PLAY_LATENCY
+    );
+    printf("  bridge, codec:  %6.1f ms (the rest)\n", rest);
+
+cu:
+    probe_stop();
+    if(fds[0] > -1) close(fds[0]);
+    if(fds[1] > -1) close(fds[1]);
+    if(pid > 0){
+        // give it a moment to see the hangup, then insist
+        int status;
+        for(int i = 0; i < 30; i++){
+            if(waitpid(pid, &status, WNOHANG) != 0) goto reaped;
+            usleep(100000);
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+reaped:
+    return retval;
+}
+
+
+// latency modes skip the sound card and the registrar entirely
+int latency_start(pjsip_globals_t *pg){
+    pj_status_t pret = pjsua_set_null_snd_dev();
+    if(pret != PJ_SUCCESS){
+        //psjua_perror("sender", "title", pret);
+        return 38;
+    }
+    int ret = latency_codecs();
+    if(ret){
+        log_printf("failed to configure codecs\n");
+        return 37;
+    }
+    if(pg->mode == MODE_ECHO) return echo_run(pg);
+    return latency_run(pg);
+}
+
+
 int pjstart(pjsip_globals_t *pg){
     pj_status_t pret = pjsua_start();
     if(pret != PJ_SUCCESS){
@@ -334,6 +2192,8 @@ int pjstart(pjsip_globals_t *pg){
         return 30;
     }
 
+    if(pg->mode != MODE_CALL) return latency_start(pg);
+
     /* I know there's no echo from my headset side, but I hear a slight echo
        on the phone side anyway.  I thought that might be due to ghost echos
        created by echo cancellation, but when I disabled echo cancellation it
@@ -345,6 +2205,14 @@ int pjstart(pjsip_globals_t *pg){
     //     return 32;
     // }
 
+    #ifdef AUDIO_SOCKET_PATH
+    // call audio goes to the audio socket; there's no sound device at all
+    pret = pjsua_set_null_snd_dev();
+    if(pret != PJ_SUCCESS){
+        //psjua_perror("sender", "title", pret);
+        return 38;
+    }
+    #else // not AUDIO_SOCKET_PATH
     pjmedia_snd_dev_info info[100];
     unsigned count = 100;
 
@@ -357,10 +2225,10 @@ int pjstart(pjsip_globals_t *pg){
 
     // find the pulse sound device
     int pulse = -1;
-    fprintf(stderr, "sound device count = %u\n", count);
+    log_printf("sound device count = %u\n", count);
     for(unsigned i = 0; i < count; i++){
         pjmedia_snd_dev_info inf = info[i];
-        fprintf(stderr,
+        log_printf(
             "sound device name: \"% .40s\" inputs: %u outputs %u\n",
             inf.name, inf.input_count, inf.output_count
         );
@@ -370,18 +2238,18 @@ int pjstart(pjsip_globals_t *pg){
         }
     }
     if(pulse < 0){
-        fprintf(stderr, "did not find pulse sound device!\n");
+        log_printf("did not find pulse sound device!\n");
         return 34;
     }
 
     // validate the pulse sound device
     pjmedia_snd_dev_info pulse_dev = info[pulse];
     if(info[pulse].input_count == 0){
-        fprintf(stderr, "pulse has no inputs!\n");
+        log_printf("pulse has no inputs!\n");
         return 35;
     }
     if(info[pulse].output_count == 0){
-        fprintf(stderr, "pulse has no ouputs!\n");
+        log_printf("pulse has no ouputs!\n");
         return 36;
     }
 
@@ -393,6 +2261,13 @@ int pjstart(pjsip_globals_t *pg){
     }
     // use pulse for the ring as well
     ring_snd_dev = pulse;
+    #endif // AUDIO_SOCKET_PATH
+
+    int ret = set_codec_vad();
+    if(ret){
+        log_printf("failed to configure codec vad\n");
+        return 37;
+    }
 
     return reg_unreg(pg);
 }
@@ -408,7 +2283,7 @@ int guess_ca_list_file(pj_str_t *out){
         if(ret < 0){
             // ignore missing files; that's kinda the point
             if(errno != ENOENT && errno != ENOTDIR){
-                perror(paths[i]);
+                log_printf("%s: %s\n", paths[i], strerror(errno));
             }
             continue;
         }
@@ -419,21 +2294,46 @@ int guess_ca_list_file(pj_str_t *out){
         *out = pj_str(paths[i]);
         return 0;
     }
-    fprintf(stderr,
+    log_printf(
         "could not find a TLS certificate bundle; "
         "checked the following locations:\n"
     );
     for(size_t i = 0; i < npaths; i++){
-        fprintf(stderr, "- %s\n", paths[i]);
+        log_printf("- %s\n", paths[i]);
     }
     return -1;
 }
 #endif // USE_TLS
 
 
+// latency modes talk only to each other, over plain udp on loopback
+int latency_transport(pjsip_globals_t *pg){
+    pjsua_transport_config tc;
+    pjsua_transport_config_default(&tc);
+    tc.bound_addr = pj_str("127.0.0.1");
+    pjsua_transport_id tid;
+    pj_status_t pret = pjsua_transport_create(PJSIP_TRANSPORT_UDP, &tc, &tid);
+    if(pret != PJ_SUCCESS){
+        //psjua_perror("sender", "title", pret);
+        return 21;
+    }
+
+    int retval = pjstart(pg);
+
+    pret = pjsua_transport_close(tid, 0);
+    if(pret != PJ_SUCCESS){
+        //psjua_perror("sender", "title", pret);
+        return 22;
+    }
+    return retval;
+}
+
+
 int sip_transport(pjsip_globals_t *pg){
     int retval = 0;
 
+    if(pg->mode != MODE_CALL) return latency_transport(pg);
+
     // start with default settings
     pjsua_transport_config tc;
     pjsua_transport_config_default(&tc);
@@ -457,6 +2357,36 @@ int sip_transport(pjsip_globals_t *pg){
     pjsip_transport_type_e type = PJSIP_TRANSPORT_UDP;
     #endif // USE_TLS
 
+    #if RACE_TRANSPORTS
+    // create a transport for every path in the race
+    (void)type;
+    size_t ntids = 0;
+    for(size_t i = 0; i < RACE_NPATHS; i++){
+        pj_status_t pret = pjsua_transport_create(
+            race_paths[i].type, &tc, &pg->tids[i]
+        );
+        if(pret != PJ_SUCCESS){
+            // probably no ipv6 here; that path just sits out the race
+            log_printf("failed to create %s transport\n", race_paths[i].name);
+            pg->tids[i] = PJSUA_INVALID_ID;
+            continue;
+        }
+        ntids++;
+    }
+    if(!ntids) return 21;
+
+    retval = pjstart(pg);
+
+    for(size_t i = 0; i < RACE_NPATHS; i++){
+        if(pg->tids[i] == PJSUA_INVALID_ID) continue;
+        pj_status_t pret = pjsua_transport_close(pg->tids[i], 0);
+        if(pret != PJ_SUCCESS){
+            //psjua_perror("sender", "title", pret);
+            return 22;
+        }
+    }
+    return retval;
+    #else // not RACE_TRANSPORTS
     // create the transport
     pjsua_transport_id tid;
     pj_status_t pret = pjsua_transport_create(type, &tc, &tid);
@@ -473,12 +2403,16 @@ int sip_transport(pjsip_globals_t *pg){
         return 22;
     }
     return retval;
+    #endif // RACE_TRANSPORTS
 }
 
 
 int setup_teardown(pjsip_globals_t *pg){
     int retval = 0;
 
+    // pjlib logs through our async logger, even during pjsua_create()
+    pj_log_set_log_func(&log_pj_writer);
+
     pj_status_t pret = pjsua_create();
     if(pret != PJ_SUCCESS){
         //psjua_perror("sender", "title", pret);
@@ -491,12 +2425,71 @@ int setup_teardown(pjsip_globals_t *pg){
     // callback so we know when call is disconnected
     pc.cb.on_call_state = &on_call_state;
     // answer incoming calls?
-    if(pg->rx){
+    if(pg->mode == MODE_ECHO){
+        pc.cb.on_incoming_call = &on_echo_incoming_call;
+    }else if(pg->rx){
         pc.cb.on_incoming_call = &on_incoming_call;
     }
     // callback to connect to opened media stream
     pc.cb.on_call_media_state = &on_call_media_state;
-    pret = pjsua_init(&pc, NULL, NULL);
+    // callback to grab stream stats as the call ends
+    pc.cb.on_stream_destroyed = &on_stream_destroyed;
+    #if USE_CN
+    // callback to offer comfort noise
+    pc.cb.on_call_sdp_created = &on_call_sdp_created;
+    #endif
+
+    #ifdef STUN_SERVERS
+    char *stun_servers[] = STUN_SERVERS;
+    size_t nstun = sizeof(stun_servers)/sizeof(*stun_servers);
+    if(nstun > PJ_ARRAY_SIZE(pc.stun_srv)){
+        log_printf(
+            "too many STUN_SERVERS (max %u)\n",
+            (unsigned)PJ_ARRAY_SIZE(pc.stun_srv)
+        );
+        retval = 14;
+        goto done;
+    }
+    for(size_t i = 0; i < nstun; i++){
+        pc.stun_srv[i] = pj_str(stun_servers[i]);
+    }
+    pc.stun_srv_cnt = nstun;
+    pc.cb.on_nat_detect = &on_nat_detect;
+    #endif // STUN_SERVERS
+
+    pjsua_media_config mc;
+    pjsua_media_config_default(&mc);
+    // any silence suppression is done by our vad gate, never the codec
+    mc.no_vad = PJ_TRUE;
+    #if USE_TONES
+    // run the bridge at the rate the tone bank was built for
+    mc.clock_rate = tones_hz;
+    #endif
+
+    #if USE_ICE
+    // calls get ICE transports we gathered in advance, not pjsua's own
+    mc.enable_ice = PJ_FALSE;
+    if(pg->mode == MODE_CALL){
+        pc.cb.on_create_media_transport = &on_create_media_transport;
+    }
+    #endif
+
+    // pjsua replaces the pjlib log writer, so hand it ours again
+    pjsua_logging_config lc;
+    pjsua_logging_config_default(&lc);
+    lc.cb = &log_pj_writer;
+
+    if(pg->mode != MODE_CALL){
+        // measure the plainest possible call: no stun, ice, vad or echo
+        // canceller, and a bridge running at PCMU's clock rate
+        pc.stun_srv_cnt = 0;
+        mc.ec_tail_len = 0;
+        mc.clock_rate = 8000;
+        // keep the report readable
+        lc.console_level = 2;
+    }
+
+    pret = pjsua_init(&pc, &lc, &mc);
     if(pret != PJ_SUCCESS){
         //psjua_perror("sender", "title", pret);
         retval = 12;
@@ -515,8 +2508,14 @@ done:
 }
 
 int main(int argc, char** argv){
-    pjsip_globals_t pg;
-    if(argc < 2){
+    pjsip_globals_t pg = { .mode = MODE_CALL };
+    if(argc == 2 && strcmp(argv[1], "--latency") == 0){
+        pg.mode = MODE_LATENCY;
+        pg.rx = false;
+    }else if(argc == 2 && strcmp(argv[1], "--echo") == 0){
+        pg.mode = MODE_ECHO;
+        pg.rx = true;
+    }else if(argc < 2){
         pg.rx = true;
     }else{
         pg.rx = false;
@@ -544,8 +2543,22 @@ int main(int argc, char** argv){
         pg.phone_number[idx] = '\0';
     }
 
+    // callbacks need to know the mode too
+    mode = pg.mode;
+
     // set sigint
     signal(SIGINT, sigint_handler);
 
-    return setup_teardown(&pg);
+    // keep stderr writes off of the sip and media threads
+    int ret = log_start(LOG_BINARY_PATH);
+    if(ret) return 2;
+
+    int retval = setup_teardown(&pg);
+
+    log_stop();
+    unsigned long dropped = log_dropped();
+    if(dropped){
+        log_printf("dropped %lu log records\n", dropped);
+    }
+    return retval;
 }
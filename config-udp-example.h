@@ -15,3 +15,47 @@
 
 // TLS SETTINGS
 #define USE_TLS 0
+
+// NAT TRAVERSAL (all optional)
+#define STUN_SERVERS { "stun.l.google.com:19302" }
+// candidates are gathered at registration, ready for the first call
+#define USE_ICE 1
+// // TURN requires USE_ICE 1
+// #define TURN_SERVER "turn.example.com:3478"
+// #define TURN_REALM "example.com"
+// #define TURN_USERNAME "my-turn-username"
+// #define TURN_PASSWORD "my-turn-password"
+// // one of PJ_TURN_TP_{UDP,TCP,TLS}
+// #define TURN_CONN_TYPE PJ_TURN_TP_UDP
+
+// SILENCE SUPPRESSION (all optional)
+#define USE_VAD 1
+// silence threshold in pjmedia's signal level units; higher suppresses more
+// but may clip the start of words.  -1 adapts to the background noise.
+#define VAD_THRESHOLD -1
+// offer RFC 3389 comfort noise (defaults to USE_VAD)
+#define USE_CN 1
+
+// LOGGING (optional)
+// append binary log records here instead of dumping them as hex to stderr
+// #define LOG_BINARY_PATH "/tmp/call.binlog"
+
+// TRANSPORT RACING (optional)
+// register over ipv4 and ipv6 (and udp and tcp, without tls) at once, and
+// use whichever registers first
+// #define RACE_TRANSPORTS 1
+// #define RACE_STAGGER_MS 250
+// #define RACE_TIMEOUT_MS 32000
+// // where the winner is remembered; defaults to ~/.cache/call-transport
+// #define RACE_STATE_PATH "/var/tmp/call-transport"
+
+// AUDIO SOCKET (optional)
+// send call audio to a unix socket instead of the sound card
+// #define AUDIO_SOCKET_PATH "/run/call/audio.sock"
+
+// LOCAL TONES (optional)
+// dtmf sidetone, ringback and busy signals on your speaker
+// (not available with AUDIO_SOCKET_PATH)
+// #define USE_TONES 1
+// #define DTMF_SIDETONE_MS 160
+// #define BUSY_TONE_MS 3000
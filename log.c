@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+// bytes in each thread's ring; must be a power of two
+#define RING_SIZE 65536
+// longest record we will queue; longer text gets truncated
+#define MAX_DATA 4096
+// how long the drain thread sleeps when every ring is empty
+#define IDLE_NSEC 5000000
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+// every record in a ring starts with a rec_hdr_t, from log.h
+
+/* A single-producer, single-consumer byte ring.  head and tail count bytes
+   ever written and read; only the owning thread moves head and only the
+   drain thread moves tail, so neither side ever takes a lock. */
+typedef struct ring {
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    struct ring *next;
+    uint32_t tid;
+    char buf[RING_SIZE];
+} ring_t;
+
+// every ring ever created; rings are only ever pushed, never removed
+static _Atomic(ring_t*) rings = NULL;
+static __thread ring_t *my_ring = NULL;
+static atomic_ulong dropped = 0;
+static atomic_bool running = false;
+static pthread_t drainer;
+static int bin_fd = -1;
+
+typedef struct {
+    char buf[8192];
+    size_t len;
+} out_t;
+
+static void write_all(int fd, const char *p, size_t n){
+    while(n){
+        ssize_t zret = write(fd, p, n);
+        if(zret < 0){
+            if(errno == EINTR) continue;
+            // nowhere left to report this
+            return;
+        }
+        p += zret;
+        n -= (size_t)zret;
+    }
+}
+
+static void out_flush(out_t *o){
+    write_all(2, o->buf, o->len);
+    o->len = 0;
+}
+
+static void out_put(out_t *o, const char *p, size_t n){
+    if(n > sizeof(o->buf) - o->len) out_flush(o);
+    if(n > sizeof(o->buf)){
+        write_all(2, p, n);
+        return;
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+static void emit(out_t *o, const rec_hdr_t *h, const char *data){
+    if(h->kind == KIND_TEXT){
+        out_put(o, data, h->len);
+        out_put(o, "\n", 1);
+        return;
+    }
+    if(bin_fd > -1){
+        write_all(bin_fd, (const char*)h, sizeof(*h));
+        write_all(bin_fd, data, h->len);
+        return;
+    }
+    // no binary log file; dump it as hex instead
+    char line[128];
+    int n = snprintf(line, sizeof(line),
+        "binary record: type=%u tid=%u len=%u\n", h->type, h->tid, h->len
+    );
+    out_put(o, line, (size_t)n);
+    for(size_t i = 0; i < h->len; i += 32){
+        size_t pos = 0;
+        line[pos++] = ' ';
+        for(size_t j = i; j < h->len && j < i + 32; j++){
+            pos += snprintf(
+                line + pos, sizeof(line) - pos, "%.2x", (unsigned char)data[j]
+            );
+        }
+        line[pos++] = '\n';
+        out_put(o, line, pos);
+    }
+}
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// copy into the ring at an absolute position, wrapping as needed
+static void ring_write(ring_t *r, uint64_t pos, const void *src, size_t n){
+    size_t off = pos & (RING_SIZE - 1);
+    size_t first = RING_SIZE - off;
+    if(first > n) first = n;
+    memcpy(r->buf + off, src, first);
+    memcpy(r->buf, (const char*)src + first, n - first);
+}
+
+static void ring_read(ring_t *r, uint64_t pos, void *dst, size_t n){
+    size_t off = pos & (RING_SIZE - 1);
+    size_t first = RING_SIZE - off;
+    if(first > n) first = n;
+    memcpy(dst, r->buf + off, first);
+    memcpy((char*)dst + first, r->buf, n - first);
+}
+
+static ring_t *get_ring(void){
+    if(my_ring) return my_ring;
+    // a thread's first log call pays for one allocation, and that's it
+    ring_t *r = calloc(1, sizeof(*r));
+    if(!r) return NULL;
+    r->tid = (uint32_t)syscall(SYS_gettid);
+    ring_t *old = atomic_load(&rings);
+    do {
+        r->next = old;
+    } while(!atomic_compare_exchange_weak(&rings, &old, r));
+    my_ring = r;
+    return r;
+}
+
+static void push(uint8_t kind, uint16_t type, const void *data, size_t len){
+    if(len > MAX_DATA) len = MAX_DATA;
+    rec_hdr_t h = {
+        .ns = now_ns(),
+        .type = type,
+        .len = (uint16_t)len,
+        .kind = kind,
+    };
+
+    if(!atomic_load_explicit(&running, memory_order_acquire)){
+        // no drain thread; just write it out ourselves
+        h.tid = (uint32_t)syscall(SYS_gettid);
+        out_t o = { .len = 0 };
+        emit(&o, &h, data);
+        out_flush(&o);
+        return;
+    }
+
+    ring_t *r = get_ring();
+    if(!r){
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    h.tid = r->tid;
+    size_t need = ALIGN8(sizeof(h) + len);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if(RING_SIZE - (head - tail) < need){
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring_write(r, head, &h, sizeof(h));
+    ring_write(r, head + sizeof(h), data, len);
+    atomic_store_explicit(&r->head, head + need, memory_order_release);
+}
+
+/* Drain every ring, merging records by timestamp so lines from different
+   threads come out in the order they were logged.  Returns true if any
+   records were drained. */
+static bool drain(out_t *o){
+    bool any = false;
+    static char data[MAX_DATA];
+    while(true){
+        ring_t *best = NULL;
+        rec_hdr_t best_h;
+        for(ring_t *r = atomic_load(&rings); r; r = r->next){
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+            if(head == tail) continue;
+            rec_hdr_t h;
+            ring_read(r, tail, &h, sizeof(h));
+            if(!best || h.ns < best_h.ns){
+                best = r;
+                best_h = h;
+            }
+        }
+        if(!best) break;
+        uint64_t tail = atomic_load_explicit(&best->tail, memory_order_relaxed);
+        ring_read(best, tail + sizeof(best_h), data, best_h.len);
+        // release the space before the (possibly slow) write
+        atomic_store_explicit(
+            &best->tail,
+            tail + ALIGN8(sizeof(best_h) + best_h.len),
+            memory_order_release
+        );
+        emit(o, &best_h, data);
+        any = true;
+    }
+    out_flush(o);
+    return any;
+}
+
+static void *drain_main(void *arg){
+    (void)arg;
+    static out_t o;
+    while(atomic_load_explicit(&running, memory_order_acquire)){
+        if(!drain(&o)){
+            struct timespec ts = { .tv_nsec = IDLE_NSEC };
+            nanosleep(&ts, NULL);
+        }
+    }
+    // pick up anything logged while we were stopping
+    drain(&o);
+    return NULL;
+}
+
+int log_start(const char *binary_path){
+    static bool registered = false;
+    if(atomic_load(&running)) return 0;
+    if(binary_path){
+        bin_fd = open(binary_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(bin_fd < 0){
+            perror(binary_path);
+            return -1;
+        }
+    }
+    atomic_store(&running, true);
+    int ret = pthread_create(&drainer, NULL, drain_main, NULL);
+    if(ret){
+        atomic_store(&running, false);
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        if(bin_fd > -1){ close(bin_fd); bin_fd = -1; }
+        return -1;
+    }
+    // don't lose queued records if something calls exit()
+    if(!registered){
+        atexit(log_stop);
+        registered = true;
+    }
+    return 0;
+}
+
+void log_stop(void){
+    if(!atomic_exchange(&running, false)) return;
+    pthread_join(drainer, NULL);
+    if(bin_fd > -1){ close(bin_fd); bin_fd = -1; }
+}
+
+void log_printf(const char *fmt, ...){
+    char buf[MAX_DATA];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(n < 0) return;
+    size_t len = (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1;
+    // we add our own newline when writing
+    while(len && (buf[len-1] == '\n' || buf[len-1] == '\r')) len--;
+    push(KIND_TEXT, 0, buf, len);
+}
+
+void log_binary(uint16_t type, const void *data, size_t len){
+    push(KIND_BINARY, type, data, len);
+}
+
+unsigned long log_dropped(void){
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void log_pj_writer(int level, const char *data, int len){
+    (void)level;
+    if(len < 0) return;
+    size_t n = (size_t)len;
+    while(n && (data[n-1] == '\n' || data[n-1] == '\r')) n--;
+    push(KIND_TEXT, 0, data, n);
+}
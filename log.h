@@ -0,0 +1,48 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Asynchronous logging.  Every thread that logs gets its own lock-free ring
+   buffer, and a background thread drains all the rings to stderr.  A caller
+   never waits on stderr: if its ring is full, the record is dropped and
+   counted instead.
+
+   Before log_start() and after log_stop(), records are written to stderr
+   directly, so early setup errors and exit paths still get reported. */
+
+enum { KIND_TEXT, KIND_BINARY };
+
+/* The header of every log record.  The binary log file is a sequence of
+   binary records, each this header in host byte order followed by len bytes
+   of data; kind is always KIND_BINARY there. */
+typedef struct {
+    uint64_t ns; // CLOCK_MONOTONIC
+    uint32_t tid;
+    uint16_t type;
+    uint16_t len;
+    uint8_t kind;
+    uint8_t pad[7];
+} rec_hdr_t;
+
+// start the drain thread.  Binary records are appended to binary_path, or
+// dumped as hex to stderr if binary_path is NULL.
+int log_start(const char *binary_path);
+
+// drain everything that is queued, then stop the drain thread
+void log_stop(void);
+
+// queue a line of text; a trailing newline is optional
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// queue a binary record, tagged with a caller-defined type
+void log_binary(uint16_t type, const void *data, size_t len);
+
+// how many records were dropped because a ring was full
+unsigned long log_dropped(void);
+
+// a pj_log_func, for pjsua_logging_config.cb or pj_log_set_log_func()
+void log_pj_writer(int level, const char *data, int len);
+
+#endif // LOG_H
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <pjlib.h>
+#include <pjmedia.h>
+
+/* Measure the per-packet cost of SRTP protect and unprotect for every crypto
+   suite pjmedia knows about, at the payload sizes a 20 ms RTP stream uses.
+   Use the output to pick SRTP_CRYPTO_SUITES for config.h. */
+
+typedef struct {
+    char *name;
+    // master key plus master salt, in bytes
+    size_t key_len;
+} suite_t;
+
+static const suite_t suites[] = {
+    { "AEAD_AES_256_GCM", 44 },
+    { "AEAD_AES_128_GCM", 28 },
+    { "AES_256_CM_HMAC_SHA1_80", 46 },
+    { "AES_256_CM_HMAC_SHA1_32", 46 },
+    { "AES_CM_128_HMAC_SHA1_80", 30 },
+    { "AES_CM_128_HMAC_SHA1_32", 30 },
+};
+
+typedef struct {
+    const char *codec;
+    // payload bytes in one 20 ms packet
+    size_t len;
+} payload_t;
+
+static const payload_t payloads[] = {
+    { "G.729", 20 },
+    { "opus@24k", 60 },
+    { "G.711", 160 },
+    { "L16@8k", 320 },
+};
+
+#define RTP_HDR_LEN 12
+// room for the payload plus the largest srtp trailer
+#define PKT_CAP 512
+#define NPKTS 20000
+
+static unsigned char pkts[NPKTS][PKT_CAP];
+static int pkt_lens[NPKTS];
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// write a plain rtp packet with a recognizable payload
+static int build_pkt(unsigned char *pkt, uint16_t seq, size_t payload_len){
+    uint32_t ts = (uint32_t)seq * 160;
+    uint32_t ssrc = 0x12345678;
+    pkt[0] = 0x80;
+    pkt[1] = 0;
+    pkt[2] = seq >> 8; pkt[3] = seq & 0xff;
+    pkt[4] = ts >> 24; pkt[5] = ts >> 16; pkt[6] = ts >> 8; pkt[7] = ts;
+    pkt[8] = ssrc >> 24; pkt[9] = ssrc >> 16; pkt[10] = ssrc >> 8; pkt[11] = ssrc;
+    for(size_t i = 0; i < payload_len; i++){
+        pkt[RTP_HDR_LEN + i] = (unsigned char)(seq + i);
+    }
+    return (int)(RTP_HDR_LEN + payload_len);
+}
+
+// returns 0 on success, 1 if the suite is not available, -1 on error
+static int bench(pjmedia_endpt *endpt, const suite_t *s, const payload_t *p){
+    int retval = -1;
+    pjmedia_transport *loop = NULL;
+    pjmedia_transport *srtp = NULL;
+
+    pj_status_t pret = pjmedia_transport_loop_create(endpt, &loop);
+    if(pret != PJ_SUCCESS){
+        fprintf(stderr, "failed to create loop transport\n");
+        goto cu;
+    }
+
+    pjmedia_srtp_setting opt;
+    pjmedia_srtp_setting_default(&opt);
+    opt.close_member_tp = PJ_TRUE;
+    pret = pjmedia_transport_srtp_create(endpt, loop, &opt, &srtp);
+    if(pret != PJ_SUCCESS){
+        fprintf(stderr, "failed to create srtp transport\n");
+        goto cu;
+    }
+    // srtp owns the loop transport now
+    loop = NULL;
+
+    // same key both ways, so we can unprotect what we protected
+    char key[64];
+    for(size_t i = 0; i < sizeof(key); i++) key[i] = (char)(i * 7 + 1);
+    pjmedia_srtp_crypto crypto;
+    pj_bzero(&crypto, sizeof(crypto));
+    crypto.name = pj_str(s->name);
+    crypto.key.ptr = key;
+    crypto.key.slen = (pj_ssize_t)s->key_len;
+    pret = pjmedia_transport_srtp_start(srtp, &crypto, &crypto);
+    if(pret != PJ_SUCCESS){
+        // most likely libsrtp was built without this cipher
+        retval = 1;
+        goto cu;
+    }
+
+    for(size_t i = 0; i < NPKTS; i++){
+        pkt_lens[i] = build_pkt(pkts[i], (uint16_t)i, p->len);
+    }
+
+    double t0 = now();
+    for(size_t i = 0; i < NPKTS; i++){
+        pret = pjmedia_transport_srtp_encrypt_pkt(
+            srtp, PJ_TRUE, pkts[i], &pkt_lens[i]
+        );
+        if(pret != PJ_SUCCESS){
+            fprintf(stderr, "protect failed for %s\n", s->name);
+            goto cu;
+        }
+    }
+    double t1 = now();
+    int srtp_len = pkt_lens[0];
+    for(size_t i = 0; i < NPKTS; i++){
+        pret = pjmedia_transport_srtp_decrypt_pkt(
+            srtp, PJ_TRUE, pkts[i], &pkt_lens[i]
+        );
+        if(pret != PJ_SUCCESS){
+            fprintf(stderr, "unprotect failed for %s\n", s->name);
+            goto cu;
+        }
+    }
+    double t2 = now();
+
+    // make sure the round trip actually worked
+    unsigned char check[PKT_CAP];
+    for(size_t i = 0; i < NPKTS; i++){
+        int len = build_pkt(check, (uint16_t)i, p->len);
+        if(pkt_lens[i] != len || memcmp(check, pkts[i], len)){
+            fprintf(stderr, "round trip mismatch for %s\n", s->name);
+            goto cu;
+        }
+    }
+
+    double protect_ns = (t1 - t0) * 1e9 / NPKTS;
+    double unprotect_ns = (t2 - t1) * 1e9 / NPKTS;
+    printf(
+        "%-24s %-9s %4zu %4d %10.0f %10.0f\n",
+        s->name, p->codec, p->len, srtp_len - (int)(RTP_HDR_LEN + p->len),
+        protect_ns, unprotect_ns
+    );
+
+    retval = 0;
+
+cu:
+    if(srtp) pjmedia_transport_close(srtp);
+    if(loop) pjmedia_transport_close(loop);
+    return retval;
+}
+
+int main(int argc, char **argv){
+    (void)argc; (void)argv;
+    int retval = 1;
+    bool cp_ok = false;
+    pjmedia_endpt *endpt = NULL;
+    pj_caching_pool cp;
+
+    pj_status_t pret = pj_init();
+    if(pret != PJ_SUCCESS){
+        fprintf(stderr, "pj_init failed\n");
+        return 1;
+    }
+    // keep pjlib quiet; we only want the table
+    pj_log_set_level(1);
+
+    pj_caching_pool_init(&cp, NULL, 0);
+    cp_ok = true;
+
+    pret = pjmedia_endpt_create(&cp.factory, NULL, 1, &endpt);
+    if(pret != PJ_SUCCESS){
+        fprintf(stderr, "failed to create media endpoint\n");
+        goto cu;
+    }
+
+    printf(
+        "%-24s %-9s %4s %4s %10s %10s\n",
+        "suite", "codec", "len", "ovh", "protect", "unprotect"
+    );
+    printf(
+        "%-24s %-9s %4s %4s %10s %10s\n",
+        "", "", "(B)", "(B)", "(ns/pkt)", "(ns/pkt)"
+    );
+    size_t nsuites = sizeof(suites)/sizeof(*suites);
+    size_t npayloads = sizeof(payloads)/sizeof(*payloads);
+    for(size_t i = 0; i < nsuites; i++){
+        for(size_t j = 0; j < npayloads; j++){
+            int ret = bench(endpt, &suites[i], &payloads[j]);
+            if(ret < 0) goto cu;
+            if(ret > 0){
+                printf("%-24s unsupported by this libsrtp\n", suites[i].name);
+                break;
+            }
+        }
+    }
+
+    retval = 0;
+
+cu:
+    if(endpt) pjmedia_endpt_destroy(endpt);
+    if(cp_ok) pj_caching_pool_destroy(&cp);
+    pj_shutdown();
+    return retval;
+}
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
 
 typedef struct {
     const char *ptr;
@@ -172,9 +173,190 @@ int read_wav(const char *buf, size_t len, FILE *f){
     return 0;
 }
 
+/* Maximal-length sequence taps, for orders 8 through 16: each row is a
+   polynomial with exponents listed highest first, zero terminated. */
+static const unsigned mls_taps[][5] = {
+    {8, 6, 5, 4, 0},
+    {9, 5, 0},
+    {10, 7, 0},
+    {11, 9, 0},
+    {12, 6, 4, 1, 0},
+    {13, 4, 3, 1, 0},
+    {14, 5, 3, 1, 0},
+    {15, 14, 0},
+    {16, 15, 13, 4, 0},
+};
+
+// emit a C file with one period of an MLS, as 16-bit PCM like wav_data
+int write_mls(unsigned order, FILE *f){
+    if(order < 8 || order > 16) FAIL("mls order must be between 8 and 16");
+    const unsigned *taps = mls_taps[order - 8];
+    uint32_t nsamples = (1u << order) - 1;
+    // loud enough to measure, with room to spare for codec overshoot
+    uint16_t amplitude = 0x2000;
+
+    fprintf(f, "const unsigned mls_order = %u;\n", order);
+    fprintf(f, "const unsigned mls_samples = %u;\n", nsamples);
+    fprintf(f, "const unsigned char mls_data[] = {\n    \"");
+    // fibonacci lfsr; any nonzero seed walks the full period
+    uint32_t state = 1;
+    for(uint32_t x = 0; x < nsamples; x++){
+        if(x % 8 == 0 && x) fprintf(f, "\"\n    \"");
+        uint32_t bit = 0;
+        for(size_t i = 0; taps[i]; i++){
+            bit ^= state >> (order - taps[i]);
+        }
+        bit &= 1;
+        uint16_t sample16 = (state & 1) ? amplitude : (uint16_t)-amplitude;
+        state = (state >> 1) | (bit << (order - 1));
+        fprintf(f, "\\x%.2x\\x%.2x", sample16 & 0xff, sample16 >> 8);
+    }
+    fprintf(f, "\"\n};\n");
+    // we should be right back where we started
+    if(state != 1) FAIL("mls taps are not maximal");
+    return 0;
+}
+
+// emit 16-bit samples as a little-endian C array, just like wav_data
+void write_pcm(FILE *f, const char *name, const int16_t *samples, size_t n){
+    fprintf(f, "const unsigned char %s[] = {\n    \"", name);
+    for(size_t x = 0; x < n; x++){
+        if(x % 8 == 0 && x) fprintf(f, "\"\n    \"");
+        uint16_t sample16 = (uint16_t)samples[x];
+        fprintf(f, "\\x%.2x\\x%.2x", sample16 & 0xff, sample16 >> 8);
+    }
+    fprintf(f, "\"\n};\n");
+}
+
+/* Fill out[0:on] with a pair of tones that each complete a whole number of
+   cycles in exactly `on` samples, then out[on:total] with silence.  Looping
+   the result is seamless: every loop starts and ends at zero phase.  Each
+   frequency is nudged to the nearest whole number of cycles; returns the
+   worst relative error that caused. */
+double gen_pair(
+    int16_t *out, size_t on, size_t total,
+    unsigned hz, double f1, double f2, double amplitude
+){
+    double k1 = round(f1 * on / hz);
+    double k2 = round(f2 * on / hz);
+    for(size_t n = 0; n < on; n++){
+        double t = (double)n / on;
+        out[n] = (int16_t)lround(
+            amplitude * (sin(2 * M_PI * k1 * t) + sin(2 * M_PI * k2 * t))
+        );
+    }
+    for(size_t n = on; n < total; n++) out[n] = 0;
+    double e1 = fabs(k1 * hz / on - f1) / f1;
+    double e2 = fabs(k2 * hz / on - f2) / f2;
+    return e1 > e2 ? e1 : e2;
+}
+
+/* The tone bank: DTMF sidetones and North American ringback and busy
+   signals, precomputed at the bridge clock rate so `call` never synthesizes
+   a sample at runtime.  Every loop is a whole number of 20 ms bridge
+   frames. */
+int write_tones(unsigned hz, FILE *f){
+    if(hz < 8000 || hz > 48000 || hz % 50) FAIL("unsupported tone rate");
+    size_t frame = hz / 50;
+
+    static const char digits[] = "123456789*0#";
+    static const double rows[] = { 697, 770, 852, 941 };
+    static const double cols[] = { 1209, 1336, 1477 };
+    // the longest dtmf loop we'll accept, in frames
+    const size_t max_frames = 25;
+    // dtmf receivers must accept at least 1.5% error; stay well inside that
+    const double max_err = 0.005;
+
+    int16_t *buf = malloc(6 * hz * sizeof(*buf));
+    if(!buf) FAIL("out of memory");
+
+    fprintf(f, "const unsigned tones_hz = %u;\n", hz);
+
+    // dtmf: find the shortest whole-frame loop that stays in tune
+    size_t dtmf_samples[sizeof(digits) - 1];
+    for(size_t i = 0; i < sizeof(digits) - 1; i++){
+        double f1 = rows[i / 3];
+        double f2 = cols[i % 3];
+        size_t n = 0;
+        for(size_t k = 1; k <= max_frames; k++){
+            // -10 dBFS per tone, roughly
+            if(gen_pair(buf, k * frame, k * frame, hz, f1, f2, 0x2000) <= max_err){
+                n = k * frame;
+                break;
+            }
+        }
+        if(!n){
+            free(buf);
+            FAIL("no dtmf loop length is in tune");
+        }
+        dtmf_samples[i] = n;
+        char name[32];
+        snprintf(name, sizeof(name), "tone_dtmf_%zu", i);
+        write_pcm(f, name, buf, n);
+    }
+    fprintf(f,
+        "const struct {\n"
+        "    char digit;\n"
+        "    unsigned samples;\n"
+        "    const unsigned char *data;\n"
+        "} tone_dtmf[] = {\n"
+    );
+    for(size_t i = 0; i < sizeof(digits) - 1; i++){
+        fprintf(f,
+            "    { '%c', %zu, tone_dtmf_%zu },\n",
+            digits[i], dtmf_samples[i], i
+        );
+    }
+    fprintf(f, "};\n");
+
+    // ringback: 440 + 480 Hz, 2 s on, 4 s off
+    size_t on = 2 * hz, total = 6 * hz;
+    gen_pair(buf, on, total, hz, 440, 480, 0x0c00);
+    fprintf(f, "const unsigned tone_ringback_samples = %zu;\n", total);
+    write_pcm(f, "tone_ringback", buf, total);
+
+    // busy: 480 + 620 Hz, 0.5 s on, 0.5 s off
+    on = hz / 2, total = hz;
+    gen_pair(buf, on, total, hz, 480, 620, 0x1000);
+    fprintf(f, "const unsigned tone_busy_samples = %zu;\n", total);
+    write_pcm(f, "tone_busy", buf, total);
+
+    free(buf);
+    return 0;
+}
+
+// write a generated C file, making sure it hits the disk
+int write_generated(const char *outpath, unsigned arg, int (*gen)(unsigned, FILE*)){
+    FILE *out = fopen(outpath, "w");
+    if(!out){
+        perror(outpath);
+        return 1;
+    }
+    int retval = gen(arg, out);
+    if(retval) goto cu;
+    if(fflush(out) || fsync(fileno(out))){
+        perror(outpath);
+        retval = 1;
+    }
+cu:
+    fclose(out);
+    return retval ? 1 : 0;
+}
+
 int main(int argc, char **argv){
+    if(argc == 4 && strcmp(argv[1], "--mls") == 0){
+        return write_generated(argv[3], atoi(argv[2]), write_mls);
+    }
+    if(argc == 4 && strcmp(argv[1], "--tones") == 0){
+        return write_generated(argv[3], atoi(argv[2]), write_tones);
+    }
     if(argc < 3){
-        fprintf(stderr, "usage: %s INFILE.WAV OUT.C\n");
+        fprintf(stderr,
+            "usage: %s INFILE.WAV OUT.C\n"
+            "       %s --mls ORDER OUT.C\n"
+            "       %s --tones RATE OUT.C\n",
+            argv[0], argv[0], argv[0]
+        );
         return 1;
     }
 